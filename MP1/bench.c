@@ -0,0 +1,293 @@
+// Microbenchmarks for the building blocks of crsd.
+// crsd.c is compiled into this translation unit so that we measure the exact code paths the server runs.
+#define main crsd_main
+#include "crsd.c"
+#undef main
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+// Prevent the compiler from optimizing away the value
+template <typename T>
+inline void do_not_optimize(T const& value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/*
+ * Run fn repeatedly and measure the average time per call
+ *
+ * @parameter iterations    number of times to call fn
+ * @parameter fn            function to measure
+ *
+ * @return nanoseconds per call
+ */
+template <typename F>
+double measure(size_t iterations, F&& fn)
+{
+    // Warm up caches and branch predictors before timing
+    for (auto i = size_t {}; i < std::min(iterations, size_t { 1024 }); i++)
+        fn(i);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (auto i = size_t {}; i < iterations; i++)
+        fn(i);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+void report(std::string const& name, double ns)
+{
+    printf("  %-68s %12.1f ns/op\n", name.c_str(), ns);
+}
+
+void bench_commands()
+{
+    printf("command encode/decode\n");
+
+    auto buffer = std::make_unique<char[]>(BUFSIZ);
+    char command[] = "JOIN benchmark_room";
+    auto type = MessageType::INVALID;
+
+    report("encode_command() JOIN", measure(1'000'000, [&](size_t) {
+               do_not_optimize(encode_command(buffer.get(), command, type));
+           }));
+
+    encode_command(buffer.get(), command, type);
+
+    report("decode_command() JOIN", measure(1'000'000, [&](size_t) {
+               auto room = std::string {};
+               do_not_optimize(decode_command(buffer.get(), room));
+               do_not_optimize(room);
+           }));
+}
+
+void bench_buffers()
+{
+    printf("buffer allocation\n");
+
+    // Command handlers allocate a zeroed MAX_DATA buffer per command
+    report("std::make_unique<char[]>(MAX_DATA)", measure(1'000'000, [](size_t) {
+               auto buffer = std::make_unique<char[]>(MAX_DATA);
+               do_not_optimize(buffer.get());
+           }));
+
+    // handle_chat() allocates a zeroed BUFSIZ buffer per connection
+    report("std::make_unique<char[]>(BUFSIZ)", measure(1'000'000, [](size_t) {
+               auto buffer = std::make_unique<char[]>(BUFSIZ);
+               do_not_optimize(buffer.get());
+           }));
+
+    report("std::unique_ptr<char[]>(new char[BUFSIZ])", measure(1'000'000, [](size_t) {
+               auto buffer = std::unique_ptr<char[]>(new char[BUFSIZ]);
+               do_not_optimize(buffer.get());
+           }));
+
+    // handle_chat() clears its buffer after every message
+    auto buffer = std::make_unique<char[]>(BUFSIZ);
+
+    report("memset(buffer, 0, BUFSIZ)", measure(1'000'000, [&](size_t) {
+               memset(buffer.get(), 0, BUFSIZ);
+               do_not_optimize(buffer.get());
+           }));
+}
+
+void bench_lookup()
+{
+    printf("room lookup\n");
+
+    for (auto rooms : { 1, 4, 16, 64, 256, 1024, 16384, 131072 }) {
+        auto names = std::vector<std::string> {};
+
+        for (auto i = 0; i < rooms; i++)
+            names.push_back("room" + std::to_string(i));
+
+        // Same container type as g_chatrooms, the rooms themselves are irrelevant to lookup cost
+        auto hashed = std::unordered_map<std::string, std::unique_ptr<Room>> {};
+        auto ordered = std::map<std::string, std::unique_ptr<Room>> {};
+        auto sorted = names;
+
+        for (auto&& name : names) {
+            hashed[name] = nullptr;
+            ordered[name] = nullptr;
+        }
+
+        std::sort(sorted.begin(), sorted.end());
+
+        // Query in a scattered order so we do not measure a single hot key
+        auto query = [&](size_t i) -> std::string const& { return names[(i * 2654435761u) % rooms]; };
+        auto suffix = " (" + std::to_string(rooms) + " rooms)";
+
+        report("std::unordered_map::find" + suffix, measure(1'000'000, [&](size_t i) {
+                   do_not_optimize(hashed.find(query(i)));
+               }));
+
+        report("std::map::find" + suffix, measure(1'000'000, [&](size_t i) {
+                   do_not_optimize(ordered.find(query(i)));
+               }));
+
+        report("std::lower_bound on sorted vector" + suffix, measure(1'000'000, [&](size_t i) {
+                   do_not_optimize(std::lower_bound(sorted.begin(), sorted.end(), query(i)));
+               }));
+
+        if (rooms <= 1024) {
+            report("std::find on vector" + suffix, measure(100'000, [&](size_t i) {
+                       do_not_optimize(std::find(names.begin(), names.end(), query(i)));
+                   }));
+        }
+    }
+}
+
+void bench_multicast()
+{
+    printf("multicast\n");
+
+    // Each member uses two file descriptors
+    auto limit = rlimit {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    // Use a real room so multicast() runs exactly as it does in handle_chat()
+    auto room_lock = std::unique_lock<std::mutex>(g_room_mutex);
+    auto& room = g_chatrooms["benchmark"] = std::make_unique<Room>("benchmark");
+    room_lock.unlock();
+
+    auto message = std::string(64, 'x');
+    auto buffer = std::make_unique<char[]>(BUFSIZ);
+    auto partition_size = g_partition_size;
+    constexpr auto batch = 32;
+
+    for (auto members : { 2, 16, 64, 256, 1024, 4096, 8192 }) {
+        if (static_cast<rlim_t>(members) * 2 + 64 > limit.rlim_cur)
+            break;
+
+        // Compare walking every member on the sender's thread against handing off to broadcast workers
+        for (auto partitioned : { false, true }) {
+            g_partition_size = partitioned ? partition_size : 0;
+
+            // Client side of each socketpair, the server side is added to the room
+            auto clients = std::vector<int> {};
+            auto sender = -1;
+
+            room_lock.lock();
+
+            for (auto i = 0; i < members; i++) {
+                int pair[2];
+
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+                    perror("socketpair()");
+                    exit(EXIT_FAILURE);
+                }
+
+                if (sender < 0)
+                    sender = pair[0];
+
+                room->add_member(pair[0]);
+                clients.push_back(pair[1]);
+            }
+
+            room_lock.unlock();
+
+            auto handoff = std::chrono::steady_clock::duration {};
+            auto delivery = std::chrono::steady_clock::duration {};
+            auto rounds = std::max(4, 16384 / members);
+
+            for (auto round = 0; round < rounds; round++) {
+                auto start = std::chrono::steady_clock::now();
+
+                for (auto i = 0; i < batch; i++) {
+                    room_lock.lock();
+                    multicast(*room, sender, message.data(), message.size());
+                    room_lock.unlock();
+                }
+
+                handoff += std::chrono::steady_clock::now() - start;
+
+                // The batch has been delivered once every recipient can read all of it
+                for (auto client = clients.begin() + 1; client != clients.end(); client++)
+                    recv(*client, buffer.get(), batch * message.size(), MSG_WAITALL);
+
+                delivery += std::chrono::steady_clock::now() - start;
+            }
+
+            auto messages = static_cast<double>(rounds * batch);
+            auto suffix = std::string { partitioned ? " partitioned" : " direct" }
+                + " (" + std::to_string(members) + " members)";
+
+            report("multicast() handoff per message" + suffix,
+                   std::chrono::duration<double, std::nano>(handoff).count() / messages);
+            report("multicast() fan-out latency per message" + suffix,
+                   std::chrono::duration<double, std::nano>(delivery).count() / messages);
+
+            room_lock.lock();
+
+            for (auto peer : room->release_members())
+                close(peer);
+
+            room_lock.unlock();
+
+            for (auto client : clients)
+                close(client);
+        }
+    }
+
+    g_partition_size = partition_size;
+}
+
+void bench_chatlog()
+{
+    printf("chat log\n");
+
+    char directory[] = "/tmp/crsd-bench-XXXXXX";
+
+    if (!mkdtemp(directory)) {
+        perror("mkdtemp()");
+        return;
+    }
+
+    auto message = std::string(64, 'x');
+    auto rooms = std::vector<std::string> { "room0", "room1", "room2", "room3" };
+
+    for (auto policy : { FsyncPolicy::NONE, FsyncPolicy::INTERVAL, FsyncPolicy::BATCH }) {
+        auto name = std::string { policy == FsyncPolicy::NONE ? "none" : policy == FsyncPolicy::INTERVAL ? "interval" : "batch" };
+
+        // A small queue so that backpressure shows up as drops instead of unbounded memory
+        auto log = std::make_unique<ChatLog>(directory, policy, std::chrono::milliseconds { 100 }, 1 << 20, 1 << 20);
+
+        report("ChatLog::append() fsync " + name, measure(200'000, [&](size_t i) {
+                   do_not_optimize(log->append(rooms[i % rooms.size()], message.data(), message.size()));
+               }));
+
+        // Destroying the log flushes everything still queued
+        auto stats = log->stats();
+        log.reset();
+
+        printf("  %-68s %12lu enqueued %lu dropped %lu batches %lu fsyncs %lu max queued bytes\n", "",
+               stats.enqueued, stats.dropped, stats.batches, stats.fsyncs, stats.max_depth);
+    }
+
+    // Clean up segments
+    auto command = std::string { "rm -rf " } + directory;
+    system(command.c_str());
+}
+
+int main()
+{
+    bench_commands();
+    bench_buffers();
+    bench_lookup();
+    bench_multicast();
+    bench_chatlog();
+
+    // Rooms own detached accept threads; skip static destructors
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
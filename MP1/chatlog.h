@@ -0,0 +1,363 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// When the chat log calls fsync() on the segments it has written to
+enum class FsyncPolicy { NONE,      // Leave it to the kernel
+                         INTERVAL,  // At most once per interval
+                         BATCH,     // After every group commit
+};
+
+struct ChatLogStats {
+    uint64_t enqueued;  // Messages accepted into the queue
+    uint64_t dropped;   // Messages rejected because the queue was full
+    uint64_t written;   // Messages written to a segment
+    uint64_t bytes;     // Bytes written to segments
+    uint64_t batches;   // Group commits
+    uint64_t fsyncs;    // Calls to fsync()
+    uint64_t depth;     // Bytes currently queued
+    uint64_t max_depth; // High-water mark of queued bytes
+};
+
+/*
+ * Append-only per-room log of chat traffic.
+ *
+ * Messages are queued by the chat threads and written by a single background thread, which takes
+ * everything queued since its last pass and commits it with one write() per room. The queue is
+ * bounded; when the writer falls behind, messages are dropped and counted rather than blocking multicast.
+ *
+ * Each room is logged to "<directory>/<room>.<segment>.log"; a new segment is started once the current
+ * one exceeds the segment size. Every record is "<unix time in ms> <length> <message>\n".
+ */
+class ChatLog {
+private:
+    struct Entry {
+        std::string room;
+        int64_t time;
+        std::string message;
+    };
+
+    struct Segment {
+        int fd;
+        unsigned sequence;
+        size_t size;
+        bool dirty;
+    };
+
+    std::string m_directory;
+    FsyncPolicy m_policy;
+    std::chrono::milliseconds m_interval;
+    size_t m_segment_size;
+    size_t m_capacity;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::vector<Entry> m_queue;
+    size_t m_depth;
+    bool m_stop;
+
+    // Only accessed by the writer thread
+    std::unordered_map<std::string, Segment> m_segments;
+    std::chrono::steady_clock::time_point m_last_fsync;
+    std::chrono::steady_clock::time_point m_last_report;
+    uint64_t m_reported_drops;
+
+    std::atomic<uint64_t> m_enqueued;
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<uint64_t> m_written;
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_batches;
+    std::atomic<uint64_t> m_fsyncs;
+    std::atomic<uint64_t> m_max_depth;
+
+    std::thread m_writer;
+
+    std::string path(std::string const& room, unsigned sequence) const
+    {
+        // Room names come from clients; keep them from escaping the log directory
+        auto name = room;
+
+        for (auto&& c : name)
+            if (c == '/')
+                c = '_';
+
+        return m_directory + "/" + name + "." + std::to_string(sequence) + ".log";
+    }
+
+    void open_segment(std::string const& room, Segment& segment)
+    {
+        segment.fd = open(path(room, segment.sequence).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (segment.fd < 0) {
+            perror("open(): chat log");
+            return;
+        }
+
+        struct stat info {};
+        fstat(segment.fd, &info);
+
+        segment.size = info.st_size;
+        segment.dirty = false;
+    }
+
+    Segment& segment(std::string const& room)
+    {
+        auto it = m_segments.find(room);
+
+        if (it != m_segments.end())
+            return it->second;
+
+        // Continue after the last segment left behind by a previous run or an earlier room with this name
+        auto segment = Segment { -1, 0, 0, false };
+        struct stat info {};
+
+        while (stat(path(room, segment.sequence + 1).c_str(), &info) == 0)
+            segment.sequence++;
+
+        open_segment(room, segment);
+
+        return m_segments[room] = segment;
+    }
+
+    void rotate(std::string const& room, Segment& segment)
+    {
+        if (segment.fd >= 0) {
+            // The old segment is complete; make it durable unless told otherwise
+            if (segment.dirty && m_policy != FsyncPolicy::NONE) {
+                fsync(segment.fd);
+                m_fsyncs++;
+            }
+
+            close(segment.fd);
+        }
+
+        segment.sequence++;
+        open_segment(room, segment);
+    }
+
+    void write_batch(std::vector<Entry>& batch)
+    {
+        // Group the batch by room so each segment gets a single write()
+        auto buffers = std::unordered_map<std::string, std::string> {};
+
+        for (auto&& entry : batch) {
+            auto& buffer = buffers[entry.room];
+
+            buffer += std::to_string(entry.time);
+            buffer += ' ';
+            buffer += std::to_string(entry.message.size());
+            buffer += ' ';
+            buffer += entry.message;
+            buffer += '\n';
+        }
+
+        for (auto&& [room, buffer] : buffers) {
+            auto& current = segment(room);
+
+            if (current.size >= m_segment_size)
+                rotate(room, current);
+
+            if (current.fd < 0)
+                continue;
+
+            auto cursor = buffer.data();
+            auto remaining = buffer.size();
+
+            while (remaining) {
+                auto bytes = write(current.fd, cursor, remaining);
+
+                if (bytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+
+                    perror("write(): chat log");
+                    break;
+                }
+
+                cursor += bytes;
+                remaining -= bytes;
+            }
+
+            current.size += buffer.size() - remaining;
+            current.dirty = true;
+            m_bytes += buffer.size() - remaining;
+        }
+
+        m_written += batch.size();
+        m_batches++;
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (m_policy == FsyncPolicy::BATCH || (m_policy == FsyncPolicy::INTERVAL && now - m_last_fsync >= m_interval))
+            sync();
+    }
+
+    void sync()
+    {
+        for (auto&& [room, segment] : m_segments) {
+            if (!segment.dirty || segment.fd < 0)
+                continue;
+
+            fsync(segment.fd);
+            segment.dirty = false;
+            m_fsyncs++;
+        }
+
+        m_last_fsync = std::chrono::steady_clock::now();
+    }
+
+    void run()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto batch = std::vector<Entry> {};
+
+        while (true) {
+            // Wake up at least once per interval so INTERVAL fsyncs are not left pending
+            m_ready.wait_for(lock, m_interval, [this]() { return m_stop || !m_queue.empty(); });
+
+            // Group commit: take everything queued since the last pass
+            batch.swap(m_queue);
+            m_depth = 0;
+
+            auto stop = m_stop;
+
+            lock.unlock();
+
+            if (!batch.empty())
+                write_batch(batch);
+            else if (m_policy == FsyncPolicy::INTERVAL)
+                sync();
+
+            batch.clear();
+
+            // Surface backpressure without flooding stderr
+            auto dropped = m_dropped.load();
+
+            if (dropped != m_reported_drops && std::chrono::steady_clock::now() - m_last_report >= m_interval) {
+                m_last_report = std::chrono::steady_clock::now();
+                std::cerr << "chat log: dropped " << dropped - m_reported_drops << " messages, writer cannot keep up\n";
+                m_reported_drops = dropped;
+            }
+
+            if (stop)
+                return;
+
+            lock.lock();
+        }
+    }
+
+public:
+    ChatLog(std::string directory,
+            FsyncPolicy policy,
+            std::chrono::milliseconds interval = std::chrono::milliseconds { 1000 },
+            size_t segment_size = 64 << 20,
+            size_t capacity = 64 << 20)
+        : m_directory(directory)
+        , m_policy(policy)
+        , m_interval(interval)
+        , m_segment_size(segment_size)
+        , m_capacity(capacity)
+        , m_depth(0)
+        , m_stop(false)
+        , m_last_fsync(std::chrono::steady_clock::now())
+        , m_last_report()
+        , m_reported_drops(0)
+        , m_enqueued(0)
+        , m_dropped(0)
+        , m_written(0)
+        , m_bytes(0)
+        , m_batches(0)
+        , m_fsyncs(0)
+        , m_max_depth(0)
+    {
+        mkdir(m_directory.c_str(), 0755);
+
+        m_writer = std::thread(&ChatLog::run, this);
+    }
+
+    ~ChatLog()
+    {
+        // Flush whatever is still queued before closing the segments
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_stop = true;
+        lock.unlock();
+
+        m_ready.notify_one();
+        m_writer.join();
+
+        if (m_policy != FsyncPolicy::NONE)
+            sync();
+
+        for (auto&& [room, segment] : m_segments)
+            if (segment.fd >= 0)
+                close(segment.fd);
+    }
+
+    /*
+     * Queue a chat message to be logged
+     *
+     * @parameter room      name of the room the message was sent to
+     * @parameter message   message as received from the client
+     * @parameter length    length of the message
+     *
+     * @return false if the message was dropped because the queue is full
+     */
+    bool append(std::string const& room, char const* message, size_t length)
+    {
+        auto time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        if (m_depth + length > m_capacity) {
+            lock.unlock();
+            m_dropped++;
+            return false;
+        }
+
+        // The writer takes the whole queue at once, so only an empty queue needs a wake up
+        auto wake = m_queue.empty();
+
+        m_queue.push_back(Entry { room, time, std::string(message, length) });
+        m_depth += length;
+
+        if (m_depth > m_max_depth)
+            m_max_depth = m_depth;
+
+        lock.unlock();
+
+        m_enqueued++;
+
+        if (wake)
+            m_ready.notify_one();
+
+        return true;
+    }
+
+    ChatLogStats stats()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto depth = m_depth;
+        lock.unlock();
+
+        return ChatLogStats {
+            m_enqueued, m_dropped, m_written, m_bytes, m_batches, m_fsyncs, depth, m_max_depth
+        };
+    }
+};
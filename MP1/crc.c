@@ -4,6 +4,7 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <cstdio>
@@ -68,6 +69,35 @@ int main(int argc, char** argv)
  */
 int connect_to(const char* host, const int port)
 {
+    // Hosts of the form "unix:<path>" connect to a server on the same machine
+    // over the Unix domain socket "<path>.<port>" instead of TCP loopback
+    if (!strncmp(host, "unix:", 5)) {
+        auto address = sockaddr_un {};
+        auto path = std::string { host + 5 } + "." + std::to_string(port);
+
+        if (path.size() >= sizeof(address.sun_path)) {
+            std::cerr << "unix socket path too long: " << path << '\n';
+            exit(EXIT_FAILURE);
+        }
+
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, path.c_str());
+
+        auto socketfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (socketfd < 0) {
+            perror("socket()");
+            exit(EXIT_FAILURE);
+        }
+
+        if (connect(socketfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            perror("connect()");
+            exit(EXIT_FAILURE);
+        }
+
+        return socketfd;
+    }
+
     // Establish a TCP connection with the server
     // No need to memset hints to 0 because it's zero initialized in C++
     auto hints = addrinfo {};
@@ -121,33 +151,11 @@ int connect_to(const char* host, const int port)
 struct Reply process_command(const int sockfd, char* command)
 {
     auto buffer = std::make_unique<char[]>(BUFSIZ);
-    auto offset = 0;
     auto message = MessageType::INVALID;
-
-    // strncasecmp is non-POSIX
-    // Compare ignore case the string to known command keywords
-    // Offset assumes a space after these commands
-    if (!strncasecmp(command, "CREATE", 6)) {
-        message = CREATE;
-        offset = 7;
-    } else if (!strncasecmp(command, "DELETE", 6)) {
-        message = DELETE;
-        offset = 7;
-    } else if (!strncasecmp(command, "JOIN", 4)) {
-        message = JOIN;
-        offset = 5;
-    } else if (!strncasecmp(command, "LIST", 4)) {
-        message = LIST;
-        offset = 4;
-    }
-
-    memcpy(buffer.get(), &message, sizeof(message));
-
-    // Offset is to ignore the command text and only pass the arguments to the server
-    strcpy(buffer.get() + sizeof(message), command + offset);
+    auto length = encode_command(buffer.get(), command, message);
 
     // Send the command to the server
-    send(sockfd, buffer.get(), sizeof(message) + strlen(command) - offset + 1, 0);
+    send(sockfd, buffer.get(), length, 0);
 
     memset(buffer.get(), 0, MAX_DATA);
 
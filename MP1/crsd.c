@@ -1,14 +1,21 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -17,11 +24,14 @@
 #include <unordered_map>
 #include <vector>
 
+#include "chatlog.h"
+#include "directory.h"
 #include "interface.h"
 #include "message.h"
 
 void handle_room(std::string room_name, int socket);
 int get_socket(std::string port, bool no_fail);
+int get_unix_socket(std::string const& path, bool no_fail);
 
 // Ports 1024 - 65534 are not restricted to superuser
 // Keep track of the next port number that we have not attempted to use
@@ -33,41 +43,400 @@ auto g_port_mutex = std::mutex {};
 // Mutex associated with g_chatrooms
 auto g_room_mutex = std::mutex {};
 
+// Rooms with more members than this split their membership into partitions of this many members,
+// each served by a dedicated broadcast worker; 0 disables partitioning
+auto g_partition_size = size_t { 256 };
+
+// Messages a partition queues at most for each member; past that the member's oldest are dropped, so a stalled
+// member cannot make the server's memory grow without bound
+auto g_partition_queue = size_t { 1024 };
+
+// Optional log of all chat traffic, written in the background
+auto g_chatlog = std::unique_ptr<ChatLog> {};
+
+// Optional persistent directory of rooms, so they survive a restart
+auto g_directory = std::unique_ptr<RoomDirectory> {};
+
+// Prefix of the Unix domain socket paths, empty if we only listen over TCP
+// Each listener is bound to "<prefix>.<port>", mirroring its TCP port
+auto g_unix_path = std::string {};
+
+/*
+ * A slice of a large room's membership served by a dedicated broadcast worker.
+ * The sending thread only hands a message off once per partition, instead of walking every member.
+ *
+ * The worker never blocks on a member: each member has its own queue, written without blocking as its socket
+ * accepts it, so a member that stalls only holds up, and past g_partition_queue loses, its own messages.
+ */
+class Partition {
+private:
+    struct Member {
+        int socket;
+        std::deque<std::shared_ptr<std::string const>> pending;
+        // Bytes of the first pending message already sent
+        size_t sent;
+        // Messages dropped because the queue was full, and how many of those were reported on stderr
+        uint64_t dropped;
+        uint64_t reported_drops;
+    };
+
+    // Only accessed by the worker thread, new members are handed over through m_joining
+    std::vector<Member> m_sockets;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::pair<int, std::shared_ptr<std::string const>>> m_queue;
+    std::vector<int> m_joining;
+    bool m_stop;
+    // Whether the worker is waiting on stalled members in poll(), and has to be woken through m_wake
+    bool m_polling;
+    int m_wake;
+
+    std::atomic<int>& m_members;
+    std::atomic<size_t> m_size;
+    std::thread m_worker;
+
+    void wake()
+    {
+        // The partition mutex should be locked before calling wake.
+
+        if (m_polling) {
+            auto one = uint64_t { 1 };
+            write(m_wake, &one, sizeof(one));
+        } else {
+            m_ready.notify_one();
+        }
+    }
+
+    void run()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto batch = decltype(m_queue) {};
+
+        while (true) {
+            auto stalled = std::vector<pollfd> { { m_wake, POLLIN, 0 } };
+
+            for (auto&& member : m_sockets)
+                if (!member.pending.empty())
+                    stalled.push_back({ member.socket, POLLOUT, 0 });
+
+            if (stalled.size() == 1) {
+                m_ready.wait(lock, [this]() { return m_stop || !m_queue.empty() || !m_joining.empty(); });
+            } else if (!m_stop && m_queue.empty() && m_joining.empty()) {
+                // Wait until a stalled member can take more, or something else comes in
+                m_polling = true;
+                lock.unlock();
+
+                poll(stalled.data(), stalled.size(), -1);
+
+                auto count = uint64_t {};
+                read(m_wake, &count, sizeof(count));
+
+                lock.lock();
+                m_polling = false;
+            }
+
+            if (m_stop)
+                return;
+
+            // Take everything that is pending so we do not hold the mutex while sending
+            for (auto socket : m_joining)
+                m_sockets.push_back(Member { socket, {}, 0, 0, 0 });
+
+            m_joining.clear();
+            batch.swap(m_queue);
+
+            lock.unlock();
+
+            for (auto&& [sender, message] : batch)
+                queue(sender, message);
+
+            batch.clear();
+
+            flush();
+
+            lock.lock();
+        }
+    }
+
+    void queue(int sender, std::shared_ptr<std::string const> const& message)
+    {
+        auto capacity = std::max<size_t>(g_partition_queue, 1);
+
+        for (auto&& member : m_sockets) {
+            if (member.socket == sender)
+                continue;
+
+            if (member.pending.size() >= capacity) {
+                member.dropped++;
+
+                // The member is stalled; make room by dropping its oldest message that it has not started on
+                if (!member.sent)
+                    member.pending.pop_front();
+                else if (member.pending.size() > 1)
+                    member.pending.erase(member.pending.begin() + 1);
+                else
+                    continue;
+            }
+
+            member.pending.push_back(message);
+        }
+    }
+
+    // Send every member as much of its queue as its socket takes without blocking
+    void flush()
+    {
+        auto member = m_sockets.begin();
+        auto dropped = uint64_t {};
+
+        while (member != m_sockets.end()) {
+            if (!send_pending(*member)) {
+                // Client closed connection, delete from vec and continue
+                close(member->socket);
+                m_members--;
+                m_size--;
+                member = m_sockets.erase(member);
+                continue;
+            }
+
+            dropped += member->dropped - member->reported_drops;
+            member->reported_drops = member->dropped;
+
+            member++;
+        }
+
+        if (dropped)
+            std::cerr << "partition: dropped " << dropped << " messages, a member cannot keep up\n";
+    }
+
+    // @return false once the member's connection is gone
+    bool send_pending(Member& member)
+    {
+        while (!member.pending.empty()) {
+            auto& message = *member.pending.front();
+            auto sent = send(member.socket, message.data() + member.sent, message.size() - member.sent, MSG_DONTWAIT);
+
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return true;
+
+                if (errno == ECONNRESET || errno == EPIPE)
+                    return false;
+
+                perror("send(): partition");
+                exit(errno);
+            }
+
+            member.sent += sent;
+
+            if (member.sent == message.size()) {
+                member.pending.pop_front();
+                member.sent = 0;
+            }
+        }
+
+        return true;
+    }
+
+public:
+    Partition(std::atomic<int>& members)
+        : m_stop(false)
+        , m_polling(false)
+        , m_wake(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        , m_members(members)
+        , m_size(0)
+    {
+        if (m_wake < 0) {
+            perror("eventfd()");
+            exit(errno);
+        }
+
+        // Started last, once every member it uses is initialized
+        m_worker = std::thread(&Partition::run, this);
+    }
+
+    ~Partition()
+    {
+        stop();
+        close(m_wake);
+    }
+
+    size_t size() const { return m_size; }
+
+    void add(int socket)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_joining.push_back(socket);
+        m_size++;
+
+        wake();
+    }
+
+    void push(int sender, std::shared_ptr<std::string const> const& message)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        // Bounded per member by the worker, which takes the whole queue every time it wakes
+        m_queue.emplace_back(sender, message);
+
+        wake();
+    }
+
+    void stop()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_stop = true;
+        wake();
+        lock.unlock();
+
+        if (m_worker.joinable())
+            m_worker.join();
+    }
+
+    // Stop the worker and hand back ownership of all member sockets; messages not yet sent are discarded
+    std::vector<int> release()
+    {
+        stop();
+
+        auto sockets = std::move(m_joining);
+
+        for (auto&& member : m_sockets)
+            sockets.push_back(member.socket);
+
+        m_sockets.clear();
+        m_size = 0;
+
+        return sockets;
+    }
+};
+
 class Room {
 public:
     int m_port;
-    int m_members;
+    std::atomic<int> m_members;
     int m_socket;
+    int m_unix_socket;
     std::thread m_handler;
     std::vector<int> m_sockets;
 
-    Room(std::string const& room_name)
+    // Non-empty once the room has outgrown g_partition_size, m_sockets is then unused
+    std::vector<std::unique_ptr<Partition>> m_partitions;
+
+    Room(std::string const& room_name, int port = 0)
         : m_members(0)
         , m_socket(0)
+        , m_unix_socket(-1)
     {
         // The room mutex should be locked before entering this constructor.
 
         auto port_lock = std::unique_lock<std::mutex>(g_port_mutex);
 
-        // Keep trying to open a socket for the chatroom on g_next_port
-        // Technically we should not be naively incrementing g_next_port in case of overflow,
-        // but I dont think we're creating over 2^16 chatrooms anytime soon
-        while ((m_socket = get_socket(std::to_string(g_next_port), true)) < 0)
-            g_next_port++;
+        // Rooms restored from the directory try to keep the port their clients already know
+        if (port <= 0 || (m_socket = get_socket(std::to_string(port), true)) < 0) {
+            // Keep trying to open a socket for the chatroom on g_next_port
+            // Technically we should not be naively incrementing g_next_port in case of overflow,
+            // but I dont think we're creating over 2^16 chatrooms anytime soon
+            while ((m_socket = get_socket(std::to_string(g_next_port), true)) < 0)
+                g_next_port++;
+
+            port = g_next_port;
+        }
 
-        m_port = g_next_port;
+        m_port = port;
 
         port_lock.unlock();
 
         // New thread to handle the individual chat room
         m_handler = std::thread(handle_room, room_name, m_socket);
         m_handler.detach();
+
+        // Co-located clients can join over a Unix domain socket instead of TCP loopback
+        if (!g_unix_path.empty()) {
+            m_unix_socket = get_unix_socket(unix_path(), true);
+
+            if (m_unix_socket >= 0) {
+                auto t = std::thread(handle_room, room_name, m_unix_socket);
+                t.detach();
+            }
+        }
     }
 
     ~Room()
     {
         // Close socket
         close(m_socket);
+
+        if (m_unix_socket >= 0) {
+            close(m_unix_socket);
+            unlink(unix_path().c_str());
+        }
+    }
+
+    std::string unix_path() const { return g_unix_path + "." + std::to_string(m_port); }
+
+    void add_member(int socket)
+    {
+        // The room mutex should be locked before calling add_member.
+
+        m_members++;
+
+        if (m_partitions.empty()) {
+            m_sockets.push_back(socket);
+
+            if (g_partition_size && m_sockets.size() > g_partition_size)
+                partition();
+
+            return;
+        }
+
+        // Fill the first partition with room to spare, otherwise start a new one
+        for (auto&& partition : m_partitions) {
+            if (partition->size() < g_partition_size) {
+                partition->add(socket);
+                return;
+            }
+        }
+
+        m_partitions.push_back(std::make_unique<Partition>(m_members));
+        m_partitions.back()->add(socket);
+    }
+
+    // Stop any broadcast workers and hand back ownership of all member sockets
+    std::vector<int> release_members()
+    {
+        // Only call release_members on a room no other thread can reach any more; it waits for the
+        // broadcast workers to stop.
+
+        auto sockets = std::move(m_sockets);
+
+        for (auto&& partition : m_partitions) {
+            auto partition_sockets = partition->release();
+            sockets.insert(sockets.end(), partition_sockets.begin(), partition_sockets.end());
+        }
+
+        m_sockets.clear();
+        m_partitions.clear();
+        m_members = 0;
+
+        return sockets;
+    }
+
+private:
+    void partition()
+    {
+        // Split the membership into partitions of g_partition_size members
+        for (auto i = size_t {}; i < m_sockets.size(); i += g_partition_size) {
+            auto partition = std::make_unique<Partition>(m_members);
+            auto end = std::min(i + g_partition_size, m_sockets.size());
+
+            for (auto j = i; j < end; j++)
+                partition->add(m_sockets[j]);
+
+            m_partitions.push_back(std::move(partition));
+        }
+
+        m_sockets.clear();
     }
 };
 
@@ -106,6 +475,10 @@ int get_socket(std::string port, bool no_fail = false)
         exit(EXIT_FAILURE);
     }
 
+    // Rooms restored after a crash re-bind ports that may still have connections in TIME_WAIT
+    auto reuse = 1;
+    setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Attempt to bind to port so we can listen to client connections
     if (bind(socketfd, result->ai_addr, result->ai_addrlen) < 0) {
         close(socketfd);
@@ -134,6 +507,101 @@ int get_socket(std::string port, bool no_fail = false)
     return socketfd;
 }
 
+/*
+ * Create a Unix domain socket to listen to for clients on the same host
+ *
+ * @parameter path      filesystem path to bind the socket to
+ * @parameter no_fail   should we exit program on failure to bind
+ *
+ * @return socket file descriptor
+ */
+int get_unix_socket(std::string const& path, bool no_fail = false)
+{
+    auto address = sockaddr_un {};
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "unix socket path too long: " << path << '\n';
+        exit(EXIT_FAILURE);
+    }
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    auto socketfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (socketfd < 0) {
+        perror("socket()");
+        exit(EXIT_FAILURE);
+    }
+
+    // Remove a stale socket left behind by a previous server
+    unlink(path.c_str());
+
+    if (bind(socketfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        close(socketfd);
+
+        if (no_fail)
+            return -1;
+
+        perror("bind()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(socketfd, -1) < 0) {
+        perror("listen()");
+        exit(EXIT_FAILURE);
+    }
+
+    return socketfd;
+}
+
+/*
+ * Send a chat message to every member of a room except the sender
+ *
+ * @parameter room      room to multicast to; g_room_mutex should be locked
+ * @parameter sender    socket the message was received on
+ * @parameter buffer    message to send
+ * @parameter bytes     length of the message
+ */
+void multicast(Room& room, int sender, char const* buffer, ssize_t bytes)
+{
+    if (!room.m_partitions.empty()) {
+        // Large rooms copy the message once and hand it off to each partition's broadcast worker
+        auto message = std::make_shared<std::string const>(buffer, bytes);
+
+        for (auto&& partition : room.m_partitions)
+            partition->push(sender, message);
+
+        return;
+    }
+
+    // Iterators are cool ;)
+    auto peer = room.m_sockets.begin();
+
+    while (peer != room.m_sockets.end()) {
+        // Multicast message by iterating through connected clients
+        if (*peer == sender) {
+            peer++;
+            continue;
+        }
+
+        if (send(*peer, buffer, bytes, 0) < 0) {
+            if (errno == ECONNRESET || errno == EPIPE) {
+                // Client closed connection, delete from vec and continue
+                close(*peer);
+                room.m_members--;
+                peer = room.m_sockets.erase(peer);
+                continue;
+            }
+
+            perror("send(): chat");
+            exit(errno);
+        }
+
+        peer++;
+    }
+}
+
 // handle_chat is a very hot function, we can aggresively inline with flatten
 __attribute__((flatten)) void handle_chat(std::string const& room_name, int socket)
 {
@@ -156,35 +624,16 @@ __attribute__((flatten)) void handle_chat(std::string const& room_name, int sock
         room_lock.lock();
 
         // Multicast message to connected clients
-        if (g_chatrooms.find(room_name) == g_chatrooms.end())
-            return;
+        auto room = g_chatrooms.find(room_name);
 
-        // Iterators are cool ;)
-        auto& room = g_chatrooms[room_name];
-        auto peer = room->m_sockets.begin();
-
-        while (peer != room->m_sockets.end()) {
-            // Multicast message by iterating through connected clients
-            if (*peer == socket) {
-                peer++;
-                continue;
-            }
-
-            if (send(*peer, buffer.get(), bytes, 0) < 0) {
-                if (errno == ECONNRESET || errno == EPIPE) {
-                    // Client closed connection, delete from vec and continue
-                    close(*peer);
-                    room->m_members--;
-                    peer = room->m_sockets.erase(peer);
-                    continue;
-                }
+        if (room == g_chatrooms.end())
+            return;
 
-                perror("send(): chat");
-                exit(errno);
-            }
+        multicast(*room->second, socket, buffer.get(), bytes);
 
-            peer++;
-        }
+        // Logging only queues the message, it never blocks the multicast
+        if (g_chatlog)
+            g_chatlog->append(room_name, buffer.get(), bytes);
 
         room_lock.unlock();
 
@@ -212,8 +661,7 @@ void handle_room(std::string room_name, int socket)
 
         auto& room = g_chatrooms[room_name];
 
-        room->m_sockets.push_back(client_socket);
-        room->m_members++;
+        room->add_member(client_socket);
 
         room_lock.unlock();
 
@@ -236,7 +684,11 @@ void handle_creation(int client, std::string const& room_name)
         room_lock.unlock();
     } else {
         // Room does not exist; create it.
-        g_chatrooms[room_name] = std::make_unique<Room>(room_name);
+        auto& room = g_chatrooms[room_name] = std::make_unique<Room>(room_name);
+
+        if (g_directory)
+            g_directory->created(room_name, room->m_port);
+
         room_lock.unlock();
 
         status = Status::SUCCESS;
@@ -266,7 +718,17 @@ void handle_deletion(int client, std::string const& room_name)
         status = Status::FAILURE_NOT_EXISTS;
         room_lock.unlock();
     } else {
-        auto& room = g_chatrooms[room_name];
+        // Taken out of the directory under the room lock, but torn down without it: releasing the members stops
+        // the room's broadcast workers, which must not hold up every other room
+        auto room = std::move(g_chatrooms[room_name]);
+
+        // Delete the chatroom
+        g_chatrooms.erase(room_name);
+
+        if (g_directory)
+            g_directory->deleted(room_name);
+
+        room_lock.unlock();
 
         // Copy DELETE message into buffer
         memcpy(buffer.get(), &message, sizeof(message));
@@ -275,23 +737,16 @@ void handle_deletion(int client, std::string const& room_name)
         // Stop accepting new connections by killing chatroom thread
         room->m_handler.~thread();
 
-        for (auto&& peer : room->m_sockets) {
-            // Send DELETE message to all connected clients
-            if (send(peer, buffer.get(), sizeof(message) + 1, 0) < 0) {
-                if (errno != ECONNRESET || errno != EPIPE)
+        for (auto&& peer : room->release_members()) {
+            // Send DELETE message to all connected clients; one that is not reading is closed without it,
+            // rather than stalling the deletion
+            if (send(peer, buffer.get(), sizeof(message) + 1, MSG_DONTWAIT) < 0)
+                if (errno != ECONNRESET && errno != EPIPE && errno != EAGAIN && errno != EWOULDBLOCK)
                     perror("send(): deletion");
 
-                continue;
-            }
-
             close(peer);
         }
 
-        // Delete the chatroom
-        g_chatrooms.erase(room_name);
-
-        room_lock.unlock();
-
         status = Status::SUCCESS;
     }
 
@@ -322,7 +777,7 @@ void handle_join(int client, std::string const& room_name)
         // It is then up to the client to create a new connection over the specified port
         auto& room = g_chatrooms[room_name];
         auto port = room->m_port;
-        auto members = room->m_members;
+        int members = room->m_members;
 
         room_lock.unlock();
 
@@ -386,8 +841,8 @@ void handle_client(int client)
         if (bytes <= 0)
             break;
 
-        auto type = reinterpret_cast<MessageType&>(*buffer.get());
-        auto room = std::string { buffer.get() + sizeof(MessageType) };
+        auto room = std::string {};
+        auto type = decode_command(buffer.get(), room);
 
         switch (type) {
         case CREATE:
@@ -417,32 +872,144 @@ void handle_client(int client)
     }
 }
 
-int main(int argc, char** argv)
+/*
+ * Continuously accept client connections on a command socket
+ *
+ * @parameter server    listening socket
+ */
+void accept_clients(int server)
 {
-    if (argc != 2) {
-        std::cerr << "usage: enter port number\n";
-        return EXIT_FAILURE;
-    }
-
-    // Bind to the port from command line arguments
-    auto server = get_socket(std::string { argv[1] });
-
     auto client = sockaddr_storage {};
     auto sin_size = socklen_t { sizeof(client) };
 
-    // Continuously accept client connections
     while (true) {
         auto client_socket = accept(server, reinterpret_cast<sockaddr*>(&client), &sin_size);
 
         if (client_socket < 0) {
             perror("accept()");
-            return EXIT_FAILURE;
+            exit(EXIT_FAILURE);
         }
 
         // Handle communication with client asynchronously
         auto t = std::thread(handle_client, client_socket);
         t.detach();
     }
+}
+
+// Recreate the rooms that existed when the server last stopped
+void restore_rooms()
+{
+    auto start = std::chrono::steady_clock::now();
+    auto rooms = g_directory->load();
+
+    auto room_lock = std::unique_lock<std::mutex>(g_room_mutex);
+
+    g_chatrooms.reserve(rooms.size());
+
+    for (auto&& [name, port] : rooms) {
+        auto& room = g_chatrooms[name] = std::make_unique<Room>(name, port);
+
+        // Port was taken in the meantime, remember the new one
+        if (room->m_port != port)
+            g_directory->created(name, room->m_port);
+    }
+
+    room_lock.unlock();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    std::cerr << "restored " << rooms.size() << " rooms in " << elapsed.count() << "ms\n";
+}
+
+void usage()
+{
+    std::cerr << "usage: enter port number [-u unix socket path] [-b broadcast partition size] [-q partition queue]\n"
+              << "       [-l chat log directory] [-f none|batch|interval[:ms]] [-r log segment size]\n"
+              << "       [-d room directory path]\n";
+}
+
+int main(int argc, char** argv)
+{
+    auto opt = 0;
+    auto log_directory = std::string {};
+    auto fsync_policy = FsyncPolicy::INTERVAL;
+    auto fsync_interval = std::chrono::milliseconds { 1000 };
+    auto segment_size = size_t { 64 << 20 };
+    auto directory_path = std::string {};
+
+    while ((opt = getopt(argc, argv, "u:b:q:l:f:r:d:")) != -1) {
+        switch (opt) {
+        case 'u':
+            g_unix_path = optarg;
+            break;
+        case 'b':
+            g_partition_size = std::stoul(optarg);
+            break;
+        case 'q':
+            g_partition_queue = std::stoul(optarg);
+            break;
+        case 'l':
+            log_directory = optarg;
+            break;
+        case 'f':
+            if (!strcmp(optarg, "none")) {
+                fsync_policy = FsyncPolicy::NONE;
+            } else if (!strcmp(optarg, "batch")) {
+                fsync_policy = FsyncPolicy::BATCH;
+            } else if (!strncmp(optarg, "interval", 8)) {
+                fsync_policy = FsyncPolicy::INTERVAL;
+
+                if (optarg[8] == ':')
+                    fsync_interval = std::chrono::milliseconds { std::stoul(optarg + 9) };
+
+                // The log writer wakes up once per interval, so a zero interval would have it spin
+                if (fsync_interval.count() == 0) {
+                    std::cerr << "fsync interval must be at least 1 ms, use -f batch to sync every commit\n";
+                    return EXIT_FAILURE;
+                }
+            } else {
+                usage();
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            segment_size = std::stoul(optarg);
+            break;
+        case 'd':
+            directory_path = optarg;
+            break;
+        default:
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 1) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (!log_directory.empty())
+        g_chatlog = std::make_unique<ChatLog>(log_directory, fsync_policy, fsync_interval, segment_size);
+
+    auto port = std::string { argv[optind] };
+
+    // Bind to the port from command line arguments
+    auto server = get_socket(port);
+
+    if (!directory_path.empty()) {
+        g_directory = std::make_unique<RoomDirectory>(directory_path);
+        restore_rooms();
+    }
+
+    // Also accept co-located clients over a Unix domain socket, bypassing the TCP stack
+    if (!g_unix_path.empty()) {
+        auto unix_server = get_unix_socket(g_unix_path + "." + port);
+
+        auto t = std::thread(accept_clients, unix_server);
+        t.detach();
+    }
+
+    accept_clients(server);
 
     return EXIT_SUCCESS;
 }
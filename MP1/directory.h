@@ -0,0 +1,422 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Persistent directory of chat rooms, so that rooms survive a server restart.
+ *
+ * The directory is stored as a compact snapshot ("<path>.snap") plus an append-only change log ("<path>.log").
+ * Creating or deleting a room appends a single record to the log; once the log outgrows the snapshot it is
+ * folded into a new snapshot by a background thread, so callers never wait for the snapshot to be written.
+ * On startup both files are memory-mapped and replayed in a single pass.
+ *
+ * Replaying a record again is harmless, since only the last record for a room decides its state. The compactor
+ * relies on that: records logged while it writes a snapshot are kept, and records the snapshot already holds
+ * are only dropped from the log once the snapshot is durable.
+ *
+ * Snapshot: "CRSD" | u32 version | u32 count | count * (u16 name length | i32 port | name)
+ * Log:      records of (u8 op | u16 name length | i32 port | name), a torn final record is ignored
+ *
+ * All integers are stored in host byte order; the files are not meant to move between machines.
+ */
+class RoomDirectory {
+private:
+    enum Op : uint8_t { CREATE = 1,
+                        DELETE = 2 };
+
+    static constexpr char MAGIC[4] = { 'C', 'R', 'S', 'D' };
+    static constexpr uint32_t VERSION = 1;
+
+    // Rooms as of the last snapshot plus every change logged since
+    std::unordered_map<std::string, int> m_rooms;
+
+    std::string m_path;
+    int m_log;
+    size_t m_log_records;
+
+    // Guards m_rooms and the log; never held while a snapshot is written
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    bool m_compact;
+    bool m_stop;
+    std::thread m_compactor;
+
+    std::string snapshot_path() const { return m_path + ".snap"; }
+    std::string log_path() const { return m_path + ".log"; }
+
+    // Map a whole file read-only, returning nullptr if it does not exist or is empty
+    static char const* map(std::string const& path, size_t& size)
+    {
+        auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info {};
+        fstat(fd, &info);
+        size = info.st_size;
+
+        auto* data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+
+        close(fd);
+
+        return data == MAP_FAILED ? nullptr : static_cast<char const*>(data);
+    }
+
+    template <typename T>
+    static bool read(char const*& cursor, char const* end, T& value)
+    {
+        if (end - cursor < static_cast<ptrdiff_t>(sizeof(T)))
+            return false;
+
+        memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+
+        return true;
+    }
+
+    void load_snapshot()
+    {
+        auto size = size_t {};
+        auto* data = map(snapshot_path(), size);
+
+        if (!data)
+            return;
+
+        auto cursor = data;
+        auto end = data + size;
+        auto version = uint32_t {};
+        auto count = uint32_t {};
+
+        if (size < sizeof(MAGIC) || memcmp(cursor, MAGIC, sizeof(MAGIC))) {
+            fprintf(stderr, "room directory: %s is not a snapshot, ignoring\n", snapshot_path().c_str());
+            munmap(const_cast<char*>(data), size);
+            return;
+        }
+
+        cursor += sizeof(MAGIC);
+
+        if (!read(cursor, end, version) || version != VERSION || !read(cursor, end, count)) {
+            fprintf(stderr, "room directory: unsupported snapshot %s, ignoring\n", snapshot_path().c_str());
+            munmap(const_cast<char*>(data), size);
+            return;
+        }
+
+        m_rooms.reserve(count);
+
+        for (auto i = uint32_t {}; i < count; i++) {
+            auto length = uint16_t {};
+            auto port = int32_t {};
+
+            if (!read(cursor, end, length) || !read(cursor, end, port) || end - cursor < length)
+                break;
+
+            m_rooms.emplace(std::string(cursor, length), port);
+            cursor += length;
+        }
+
+        munmap(const_cast<char*>(data), size);
+    }
+
+    void load_log()
+    {
+        auto size = size_t {};
+        auto* data = map(log_path(), size);
+
+        if (!data)
+            return;
+
+        auto cursor = data;
+        auto end = data + size;
+
+        while (cursor < end) {
+            auto op = uint8_t {};
+            auto length = uint16_t {};
+            auto port = int32_t {};
+
+            // A crash may leave a partially written record at the end of the log
+            if (!read(cursor, end, op) || !read(cursor, end, length) || !read(cursor, end, port) || end - cursor < length)
+                break;
+
+            auto name = std::string(cursor, length);
+            cursor += length;
+
+            if (op == CREATE)
+                m_rooms[name] = port;
+            else if (op == DELETE)
+                m_rooms.erase(name);
+        }
+
+        munmap(const_cast<char*>(data), size);
+    }
+
+    void append(Op op, std::string const& name, int32_t port)
+    {
+        if (m_log < 0)
+            return;
+
+        auto length = static_cast<uint16_t>(name.size());
+        auto record = std::string(sizeof(op) + sizeof(length) + sizeof(port), '\0');
+        auto cursor = record.data();
+
+        memcpy(cursor, &op, sizeof(op));
+        memcpy(cursor += sizeof(op), &length, sizeof(length));
+        memcpy(cursor += sizeof(length), &port, sizeof(port));
+        record.append(name, 0, length);
+
+        // Single write() on an O_APPEND file, so a record is either fully logged or torn at the tail
+        if (write(m_log, record.data(), record.size()) < 0)
+            perror("write(): room directory");
+
+        // Fold the log into a new snapshot once replaying it would cost more than the snapshot itself
+        if (++m_log_records > std::max(m_rooms.size(), size_t { 1024 }) && !m_compact) {
+            m_compact = true;
+            m_wake.notify_one();
+        }
+    }
+
+    void run()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        while (true) {
+            m_wake.wait(lock, [this]() { return m_stop || m_compact; });
+
+            if (m_stop)
+                return;
+
+            lock.unlock();
+            compact();
+            lock.lock();
+
+            m_compact = false;
+        }
+    }
+
+    // Write a snapshot of rooms to a temporary file and rename it into place, so a crash never leaves a
+    // half-written snapshot
+    bool write_snapshot(std::unordered_map<std::string, int> const& rooms)
+    {
+        auto snapshot = std::string(MAGIC, sizeof(MAGIC));
+        auto count = static_cast<uint32_t>(rooms.size());
+
+        snapshot.append(reinterpret_cast<char const*>(&VERSION), sizeof(VERSION));
+        snapshot.append(reinterpret_cast<char const*>(&count), sizeof(count));
+
+        for (auto&& [name, port] : rooms) {
+            auto length = static_cast<uint16_t>(name.size());
+            auto port32 = static_cast<int32_t>(port);
+
+            snapshot.append(reinterpret_cast<char const*>(&length), sizeof(length));
+            snapshot.append(reinterpret_cast<char const*>(&port32), sizeof(port32));
+            snapshot.append(name, 0, length);
+        }
+
+        auto temporary = snapshot_path() + ".tmp";
+        auto fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror("open(): room directory");
+            return false;
+        }
+
+        if (write(fd, snapshot.data(), snapshot.size()) != static_cast<ssize_t>(snapshot.size()) || fsync(fd) < 0) {
+            perror("write(): room directory");
+            close(fd);
+            return false;
+        }
+
+        close(fd);
+
+        // The log only drops what the snapshot holds once the snapshot is sure to be found after a crash
+        if (rename(temporary.c_str(), snapshot_path().c_str()) < 0 || !sync_directory()) {
+            perror("rename(): room directory");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Sync the directory holding the snapshot and log, so that renaming them into place survives a crash
+    bool sync_directory() const
+    {
+        auto slash = m_path.rfind('/');
+        auto directory = slash == std::string::npos ? std::string(".") : m_path.substr(0, std::max<size_t>(slash, 1));
+        auto fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd < 0)
+            return false;
+
+        auto synced = fsync(fd) == 0;
+        close(fd);
+
+        return synced;
+    }
+
+    /*
+     * Append what source holds from offset on to log
+     *
+     * @return where source ended, or -1 if it could not be copied
+     */
+    static off_t copy_records(int source, int log, off_t offset)
+    {
+        if (source < 0)
+            return offset;
+
+        auto size = lseek(source, 0, SEEK_END);
+        auto records = std::string(std::max<off_t>(size - offset, 0), '\0');
+
+        if (pread(source, records.data(), records.size(), offset) != static_cast<ssize_t>(records.size())
+            || write(log, records.data(), records.size()) != static_cast<ssize_t>(records.size()))
+            return -1;
+
+        return offset + records.size();
+    }
+
+    /*
+     * Restart the log with only the records from offset on, those logged after the last snapshot was taken.
+     * They are copied and synced without m_mutex, which is only taken to copy what was logged meanwhile and
+     * switch to the new log; callers should not hold it.
+     */
+    void restart_log(off_t offset)
+    {
+        auto temporary = log_path() + ".tmp";
+        auto log = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+        if (log < 0) {
+            perror("open(): room directory");
+            return;
+        }
+
+        // The log as it is now; appends go to the same file until the new one is renamed over it
+        auto source = open(log_path().c_str(), O_RDONLY | O_CLOEXEC);
+        auto copied = copy_records(source, log, offset);
+
+        auto lock = std::unique_lock<std::mutex>(m_mutex, std::defer_lock);
+
+        if (copied >= 0 && fsync(log) == 0) {
+            lock.lock();
+            copied = copy_records(source, log, copied);
+        }
+
+        if (source >= 0)
+            close(source);
+
+        if (!lock.owns_lock() || copied < 0 || rename(temporary.c_str(), log_path().c_str()) < 0) {
+            // Keep the whole log; replaying records the snapshot holds is harmless
+            perror("room directory: restarting log");
+            close(log);
+            unlink(temporary.c_str());
+            return;
+        }
+
+        if (m_log >= 0)
+            close(m_log);
+
+        m_log = log;
+
+        lock.unlock();
+
+        // Records logged while the new log was being synced, and its name
+        if (fsync(log) < 0 || !sync_directory())
+            perror("fsync(): room directory log");
+    }
+
+public:
+    RoomDirectory(std::string path)
+        : m_path(path)
+        , m_log(-1)
+        , m_log_records(0)
+        , m_compact(false)
+        , m_stop(false)
+        , m_compactor(&RoomDirectory::run, this)
+    {
+    }
+
+    ~RoomDirectory()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_stop = true;
+        lock.unlock();
+
+        m_wake.notify_one();
+        m_compactor.join();
+
+        if (m_log >= 0)
+            close(m_log);
+    }
+
+    /*
+     * Rebuild the directory from the snapshot and change log, then compact them
+     *
+     * @return name and port of every room that existed when the server stopped
+     */
+    std::vector<std::pair<std::string, int>> load()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        load_snapshot();
+        load_log();
+
+        auto rooms = std::vector<std::pair<std::string, int>>(m_rooms.begin(), m_rooms.end());
+
+        lock.unlock();
+
+        // Start from a fresh snapshot and an empty log
+        compact();
+
+        return rooms;
+    }
+
+    /*
+     * Write the current directory to a new snapshot and drop the records it holds from the log. Only the copy of
+     * the directory is taken under m_mutex; the snapshot is written and synced without it.
+     */
+    void compact()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto rooms = m_rooms;
+        auto offset = m_log >= 0 ? lseek(m_log, 0, SEEK_END) : 0;
+
+        m_log_records = 0;
+
+        lock.unlock();
+
+        if (!write_snapshot(rooms))
+            return;
+
+        restart_log(offset);
+    }
+
+    void created(std::string const& name, int port)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_rooms[name] = port;
+        append(CREATE, name, port);
+    }
+
+    void deleted(std::string const& name)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_rooms.erase(name);
+        append(DELETE, name, 0);
+    }
+};
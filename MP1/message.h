@@ -1,5 +1,10 @@
 #pragma once
 
+#include <strings.h>
+
+#include <cstring>
+#include <string>
+
 enum MessageType { INVALID,
                    CREATE,      // Create new room              (client  -> server)
                    DELETE,      // Delete room                  (client <-> server)
@@ -7,3 +12,61 @@ enum MessageType { INVALID,
                    LIST,        // List all rooms               (client  -> server)
                    RESPONSE,    // Response from other commands (server  -> client)
 };
+
+/*
+ * Encode a user command into the wire format expected by the server
+ *
+ * @parameter buffer    destination buffer, should be able to hold MAX_DATA bytes
+ * @parameter command   command as typed by the user, e.g. "JOIN room"
+ * @parameter type      set to the MessageType of the command
+ *
+ * @return number of bytes to send
+ */
+inline size_t encode_command(char* buffer, char const* command, MessageType& type)
+{
+    auto offset = 0;
+
+    type = MessageType::INVALID;
+
+    // strncasecmp is non-POSIX
+    // Compare ignore case the string to known command keywords
+    // Offset assumes a space after these commands
+    if (!strncasecmp(command, "CREATE", 6)) {
+        type = CREATE;
+        offset = 7;
+    } else if (!strncasecmp(command, "DELETE", 6)) {
+        type = DELETE;
+        offset = 7;
+    } else if (!strncasecmp(command, "JOIN", 4)) {
+        type = JOIN;
+        offset = 5;
+    } else if (!strncasecmp(command, "LIST", 4)) {
+        type = LIST;
+        offset = 4;
+    }
+
+    memcpy(buffer, &type, sizeof(type));
+
+    // Offset is to ignore the command text and only pass the arguments to the server
+    strcpy(buffer + sizeof(type), command + offset);
+
+    return sizeof(type) + strlen(command) - offset + 1;
+}
+
+/*
+ * Decode a command received from a client
+ *
+ * @parameter buffer    buffer received from the client
+ * @parameter argument  set to the null-terminated argument following the message type
+ *
+ * @return MessageType of the command
+ */
+inline MessageType decode_command(char const* buffer, std::string& argument)
+{
+    auto type = MessageType {};
+
+    memcpy(&type, buffer, sizeof(type));
+    argument.assign(buffer + sizeof(type));
+
+    return type;
+}
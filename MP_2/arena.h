@@ -0,0 +1,40 @@
+#pragma once
+
+#include <google/protobuf/arena.h>
+#include <grpcpp/support/message_allocator.h>
+
+/*
+ * Allocates the request and reply of a unary RPC in a protobuf arena that is freed in one go once the RPC is done.
+ *
+ * The arena's first block is part of the holder, so an RPC whose messages fit in it costs a single allocation
+ * instead of one for every message, string and repeated field.
+ */
+template <typename RequestT, typename ResponseT>
+class ArenaAllocator final : public grpc::MessageAllocator<RequestT, ResponseT> {
+private:
+    class Holder final : public grpc::MessageHolder<RequestT, ResponseT> {
+    private:
+        // Enough for every request and most replies; larger replies (List) continue in blocks of their own
+        alignas(16) char m_block[2048];
+        google::protobuf::Arena m_arena;
+
+    public:
+        Holder()
+            : m_arena(m_block, sizeof(m_block))
+        {
+            this->set_request(google::protobuf::Arena::CreateMessage<RequestT>(&m_arena));
+            this->set_response(google::protobuf::Arena::CreateMessage<ResponseT>(&m_arena));
+        }
+
+        void Release() override
+        {
+            delete this;
+        }
+    };
+
+public:
+    grpc::MessageHolder<RequestT, ResponseT>* AllocateMessages() override
+    {
+        return new Holder();
+    }
+};
@@ -0,0 +1,288 @@
+// Concurrency benchmark for tsd: how posting throughput scales with the number of posting threads.
+// tsd.cc is compiled into this translation unit so that we measure the exact code paths the server runs.
+#define main tsd_main
+#include "tsd.cc"
+#undef main
+
+#include <new>
+#include <random>
+
+// Heap allocations made by this thread; every operator new in the process, protobuf's included, is counted
+thread_local uint64_t allocations = 0;
+
+// Allocations made by the posting threads of the last run()
+std::atomic<uint64_t> run_allocations {};
+
+void* operator new(size_t size)
+{
+    allocations++;
+
+    if (auto* pointer = malloc(size))
+        return pointer;
+
+    throw std::bad_alloc {};
+}
+
+void operator delete(void* pointer) noexcept
+{
+    free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+void report(std::string const& name, double posts, double seconds, size_t followers)
+{
+    printf("  %-52s %12.0f posts/s %14.0f deliveries/s %8.1f allocs/post\n", name.c_str(), posts / seconds,
+           posts * followers / seconds, run_allocations / posts);
+}
+
+// A post as the timeline stream receives it: message is reused for every post, as the stream's reactor does
+Post make_message(csce438::Message& message, std::string const& username, std::string const& text)
+{
+    message.set_username(username);
+    message.set_msg(text);
+    *message.mutable_timestamp() = google::protobuf::util::TimeUtil::GetCurrentTime();
+
+    return PostTable::instance().intern(message);
+}
+
+/*
+ * Post from every thread at once and measure the throughput
+ *
+ * @parameter threads       number of posting threads
+ * @parameter posts         posts per thread
+ * @parameter poster        username each thread posts as
+ * @parameter batch         posts per call to post(), as a batch on the timeline stream
+ */
+template <typename F>
+double run(SNSServiceImpl& service, size_t threads, size_t posts, F&& poster, size_t batch = 1)
+{
+    auto workers = std::vector<std::thread> {};
+    auto ready = std::atomic<size_t> {};
+    auto go = std::atomic<bool> {};
+
+    for (auto t = size_t {}; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            auto user = service.load(poster(t));
+            auto message = csce438::Message {};
+            auto messages = std::vector<Post> {};
+            auto text = "benchmark post " + std::to_string(t) + ':';
+
+            messages.reserve(batch);
+
+            ready++;
+
+            while (!go)
+                std::this_thread::yield();
+
+            auto start = allocations;
+
+            for (auto i = size_t {}; i < posts; i += batch) {
+                messages.clear();
+
+                for (auto j = i; j < std::min(i + batch, posts); j++)
+                    messages.push_back(make_message(message, user->username, text + std::to_string(j) + '\n'));
+
+                if (batch == 1)
+                    service.post(user, messages.front());
+                else
+                    service.post(user, messages);
+            }
+
+            run_allocations += allocations - start;
+        });
+    }
+
+    while (ready < threads)
+        std::this_thread::yield();
+
+    run_allocations = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+
+    for (auto&& worker : workers)
+        worker.join();
+
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    char directory[] = "/tmp/tsd-bench-XXXXXX";
+
+    if (!mkdtemp(directory) || chdir(directory) < 0) {
+        perror("mkdtemp()");
+        return EXIT_FAILURE;
+    }
+
+    constexpr auto users = size_t { 4096 };
+    constexpr auto followers = size_t { 64 };
+    constexpr auto posts = size_t { 2000 };
+
+    {
+        auto options = ServerOptions {};
+        options.fsync = FsyncPolicy::NONE;
+        // celebrity's posts must fan out to every follower, not go to an outbox; no other user comes near the
+        // default threshold
+        options.fanout_threshold = 0;
+
+        auto service = SNSServiceImpl(options);
+        auto random = std::mt19937 { 438 };
+        auto reply = Reply {};
+
+        auto name = [](size_t i) { return "user" + std::to_string(i); };
+
+        for (auto i = size_t {}; i < users; i++) {
+            auto request = Request {};
+            request.set_username(name(i));
+            service.login(&request, &reply);
+        }
+
+        // Every user gets followers random followers, and "celebrity" is followed by everyone
+        auto celebrity = Request {};
+        celebrity.set_username("celebrity");
+        service.login(&celebrity, &reply);
+
+        for (auto i = size_t {}; i < users; i++) {
+            auto request = Request {};
+            request.add_arguments(name(i));
+
+            for (auto j = size_t {}; j < followers; j++) {
+                request.set_username(name(random() % users));
+                service.follow(&request, &reply);
+            }
+
+            request.set_username(name(i));
+            request.set_arguments(0, "celebrity");
+            service.follow(&request, &reply);
+        }
+
+        printf("posting from distinct users (%zu users, ~%zu followers each)\n", users, followers);
+
+        for (auto threads : { 1, 2, 4, 8, 16 }) {
+            auto seconds = run(service, threads, posts, [&](size_t t) { return name(t * 97 % users); });
+
+            report(std::to_string(threads) + " threads", threads * posts, seconds, followers);
+        }
+
+        constexpr auto batch = size_t { 50 };
+
+        printf("posting in batches of %zu\n", batch);
+
+        for (auto threads : { 1, 4, 16 }) {
+            auto seconds = run(
+                service, threads, posts, [&](size_t t) { return name(t * 97 % users); }, batch);
+
+            report(std::to_string(threads) + " threads", threads * posts, seconds, followers);
+        }
+
+        // Requests arrive serialized; gRPC parses them into messages from the service's allocator, see ArenaAllocator
+        printf("allocations per RPC, requests and replies on the heap or in an arena\n");
+
+        auto allocator = ArenaAllocator<Request, Reply> {};
+
+        for (auto rpc : { "Follow", "List" }) {
+            auto request = Request {};
+            request.set_username(name(0));
+            request.add_arguments(name(1));
+
+            auto wire = request.SerializeAsString();
+            auto handler = [&](Request const* request, Reply* reply) {
+                return rpc == std::string { "List" } ? service.list(request, reply) : service.follow(request, reply);
+            };
+
+            for (auto arena : { false, true }) {
+                constexpr auto rpcs = size_t { 1000 };
+                auto start = allocations;
+
+                for (auto i = size_t {}; i < rpcs; i++) {
+                    if (arena) {
+                        auto* messages = allocator.AllocateMessages();
+                        messages->request()->ParseFromString(wire);
+                        handler(messages->request(), messages->response());
+                        messages->Release();
+                    } else {
+                        auto request = std::make_unique<Request>();
+                        auto reply = std::make_unique<Reply>();
+                        request->ParseFromString(wire);
+                        handler(request.get(), reply.get());
+                    }
+                }
+
+                printf("  %-52s %8.1f allocs/RPC\n", (std::string { rpc } + (arena ? " (arena)" : " (heap)")).c_str(),
+                       static_cast<double>(allocations - start) / rpcs);
+            }
+        }
+
+        // What post() queues for a post's followers: the log record copied into every append, or built once and shared
+        printf("allocations per post logged to %zu followers, the record copied or shared\n", followers);
+
+        {
+            auto snapshots = SnapshotFile("fanout.snap");
+            snapshots.open();
+
+            auto persistence = Persistence(snapshots, FsyncPolicy::NONE);
+            auto message = csce438::Message {};
+            make_message(message, name(0), "benchmark post\n");
+
+            for (auto shared : { false, true }) {
+                constexpr auto posts = size_t { 1000 };
+                auto start = allocations;
+
+                for (auto i = size_t {}; i < posts; i++) {
+                    auto record = User::record(message);
+                    auto shared_record = shared ? std::make_shared<std::string const>(record) : nullptr;
+
+                    for (auto j = size_t {}; j < followers; j++) {
+                        auto path = "fanout" + std::to_string(j) + ".log";
+
+                        if (shared)
+                            persistence.append(std::move(path), shared_record);
+                        else
+                            persistence.append(std::move(path), record);
+                    }
+                }
+
+                printf("  %-52s %8.1f allocs/post\n", shared ? "Log records (shared)" : "Log records (copied)",
+                       static_cast<double>(allocations - start) / posts);
+            }
+        }
+
+        printf("posting while celebrity posts to %zu followers\n", users);
+
+        for (auto threads : { 1, 2, 4, 8, 16 }) {
+            auto stop = std::atomic<bool> {};
+            auto celebrity_posts = size_t {};
+
+            // A post from celebrity fans out to every user; the other threads must not stall behind it
+            auto background = std::thread([&]() {
+                auto user = service.load("celebrity");
+                auto text = csce438::Message {};
+                auto message = make_message(text, "celebrity", "celebrity post\n");
+
+                while (!stop) {
+                    service.post(user, message);
+                    celebrity_posts++;
+                }
+            });
+
+            auto seconds = run(service, threads, posts, [&](size_t t) { return name(t * 97 % users); });
+
+            stop = true;
+            background.join();
+
+            report(std::to_string(threads) + " threads (" + std::to_string(celebrity_posts) + " celebrity posts)",
+                   threads * posts, seconds, followers);
+        }
+    }
+
+    // Clean up users and logs
+    auto command = std::string { "rm -rf " } + directory;
+    system(command.c_str());
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Dense integer standing in for a username; only meaningful within one run of the server
+using UserId = uint32_t;
+
+/*
+ * Interns usernames to dense integer ids, so that the follower graph stores 4 bytes per edge instead of a string.
+ * Ids are handed out in the order names are first seen and never reused. Names are stored once, here.
+ */
+class UserIds {
+private:
+    std::shared_mutex m_mutex;
+    std::unordered_map<std::string, UserId> m_ids;
+    // A deque, so that references to names stay valid as names are added
+    std::deque<std::string> m_names;
+
+public:
+    static constexpr UserId NONE = UINT32_MAX;
+
+    static UserIds& instance()
+    {
+        static auto ids = UserIds {};
+        return ids;
+    }
+
+    // Id of name, assigning one if it has none yet
+    UserId intern(std::string const& name)
+    {
+        auto shared_lock = std::shared_lock<std::shared_mutex>(m_mutex);
+        auto it = m_ids.find(name);
+
+        if (it != m_ids.end())
+            return it->second;
+
+        shared_lock.unlock();
+
+        auto lock = std::unique_lock<std::shared_mutex>(m_mutex);
+        auto [inserted, added] = m_ids.emplace(name, static_cast<UserId>(m_names.size()));
+
+        if (added)
+            m_names.push_back(name);
+
+        return inserted->second;
+    }
+
+    // @return NONE if name was never interned
+    UserId find(std::string const& name)
+    {
+        auto lock = std::shared_lock<std::shared_mutex>(m_mutex);
+        auto it = m_ids.find(name);
+
+        return it == m_ids.end() ? NONE : it->second;
+    }
+
+    std::string const& name(UserId id)
+    {
+        // The lock only guards finding the name; the name itself never moves
+        auto lock = std::shared_lock<std::shared_mutex>(m_mutex);
+        return m_names[id];
+    }
+};
+
+/*
+ * Set of user ids kept as a sorted vector: 4 bytes per member and O(log n) lookups.
+ *
+ * A single insert() or erase() is O(n), since it moves the ids after it. That is chosen over a hashed set, which
+ * would make them O(1) but take 8-10 times the memory per edge and lose the contiguous copy a post takes of its
+ * sender's followers; for a million followers the move is 4 MB. Loaders must not insert edge by edge, which is
+ * O(n^2): assign() and update() sort once.
+ */
+class IdSet {
+private:
+    std::vector<UserId> m_ids;
+
+public:
+    using const_iterator = std::vector<UserId>::const_iterator;
+
+    // @return false if id was a member already
+    bool insert(UserId id)
+    {
+        auto it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+
+        if (it != m_ids.end() && *it == id)
+            return false;
+
+        m_ids.insert(it, id);
+        return true;
+    }
+
+    // @return false if id was not a member
+    bool erase(UserId id)
+    {
+        auto it = std::lower_bound(m_ids.begin(), m_ids.end(), id);
+
+        if (it == m_ids.end() || *it != id)
+            return false;
+
+        m_ids.erase(it);
+        return true;
+    }
+
+    // Replace the members with ids, in any order and possibly repeated
+    void assign(std::vector<UserId> ids)
+    {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+        ids.shrink_to_fit();
+
+        m_ids = std::move(ids);
+    }
+
+    // Add and remove many members at once; an id must not be in both
+    void update(std::vector<UserId> added, std::vector<UserId> removed)
+    {
+        if (added.empty() && removed.empty())
+            return;
+
+        std::sort(added.begin(), added.end());
+        std::sort(removed.begin(), removed.end());
+
+        auto kept = std::vector<UserId> {};
+        kept.reserve(m_ids.size());
+        std::set_difference(m_ids.begin(), m_ids.end(), removed.begin(), removed.end(), std::back_inserter(kept));
+
+        auto ids = std::vector<UserId> {};
+        ids.reserve(kept.size() + added.size());
+        std::set_union(kept.begin(), kept.end(), added.begin(), added.end(), std::back_inserter(ids));
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+        m_ids = std::move(ids);
+    }
+
+    bool contains(UserId id) const
+    {
+        return std::binary_search(m_ids.begin(), m_ids.end(), id);
+    }
+
+    const_iterator begin() const { return m_ids.begin(); }
+    const_iterator end() const { return m_ids.end(); }
+
+    size_t size() const { return m_ids.size(); }
+    size_t capacity() const { return m_ids.capacity(); }
+};
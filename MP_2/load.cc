@@ -0,0 +1,581 @@
+// Load generator for tsd: registers users with a power-law follow graph, opens timeline streams for some of them,
+// posts through those streams at a target rate and prints post-to-delivery latency and throughput as JSON.
+#include "sns.grpc.pb.h"
+#include <google/protobuf/util/time_util.h>
+#include <grpc++/grpc++.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+using csce438::StatsReply;
+using csce438::StatsRequest;
+using grpc::ClientContext;
+using grpc::Status;
+
+using lock_t = std::unique_lock<std::mutex>;
+
+struct LoadOptions {
+    std::string hostname = "localhost";
+    std::string port = "3010";
+    // Registered as <prefix>0 to <prefix><users - 1>
+    std::string prefix = "load";
+    size_t users = 1000;
+    // Users each user follows
+    size_t follows = 20;
+    // Exponent of the power law: user i is followed with probability proportional to 1 / (i + 1)^alpha
+    double alpha = 1.0;
+    size_t streams = 100;
+    // Posts per second, across all streams
+    double rate = 1000;
+    double seconds = 10;
+    // Seconds to wait for deliveries after the last post
+    double drain = 5;
+    // Threads registering users and follows
+    size_t threads = 4;
+    uint32_t seed = 438;
+};
+
+// Nanoseconds on the steady clock; every stream is in this process, so post and delivery times compare directly
+uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Nanoseconds on the wall clock, which the server's trace timestamps are on
+int64_t wall_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Where the time between a post being written and delivered went, from the timestamps of its Trace
+struct Phases {
+    // Client send to server receive
+    std::vector<uint64_t> to_server;
+    // Server receive to enqueue: parsing, loading and locking the sender
+    std::vector<uint64_t> to_enqueue;
+    // Enqueue to delivery: fan-out, persistence with tsd -d, and the follower's stream
+    std::vector<uint64_t> to_follower;
+};
+
+/*
+ * A timeline stream of one user. Posts carry the time they were due as their text, and every post read back
+ * that was due after `since` is measured, see OnReadDone().
+ */
+class Stream final : public grpc::ClientBidiReactor<Message, Message> {
+private:
+    ClientContext m_context;
+    std::string m_username;
+
+    std::atomic<size_t>& m_ready;
+    std::atomic<uint64_t>& m_delivered;
+    std::atomic<uint64_t>& m_last_delivery;
+    std::atomic<uint64_t> m_since;
+
+    Message m_read;
+
+    // At most one write in flight; further posts wait in m_pending
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    Message m_write;
+    std::deque<uint64_t> m_pending;
+    bool m_writing;
+    bool m_failed;
+    bool m_done;
+    Status m_status;
+
+    // Delivery latencies in nanoseconds, only touched by OnReadDone()
+    std::vector<uint64_t> m_latencies;
+    Phases m_phases;
+
+    void write(uint64_t due)
+    {
+        m_write.set_msg(std::to_string(due) + '\n');
+        using google::protobuf::util::TimeUtil;
+
+        *m_write.mutable_timestamp() = TimeUtil::GetCurrentTime();
+        *m_write.mutable_trace()->mutable_client_send() = TimeUtil::NanosecondsToTimestamp(wall_ns());
+
+        m_writing = true;
+        StartWrite(&m_write);
+    }
+
+public:
+    Stream(SNSService::Stub* stub, std::string const& username, std::atomic<size_t>& ready,
+           std::atomic<uint64_t>& delivered, std::atomic<uint64_t>& last_delivery)
+        : m_username(username)
+        , m_ready(ready)
+        , m_delivered(delivered)
+        , m_last_delivery(last_delivery)
+        , m_since(UINT64_MAX)
+        , m_writing(true)
+        , m_failed(false)
+        , m_done(false)
+    {
+        stub->async()->Timeline(&m_context, this);
+
+        // The server expects the magic string first, see processTimeline() in tsc.cc
+        m_write.set_username(username);
+        m_write.set_msg("0xFEE1DEAD");
+
+        StartWrite(&m_write);
+        StartRead(&m_read);
+        StartCall();
+    }
+
+    // Measure posts due from now on; earlier ones are the timeline replayed when the stream opened
+    void measure(uint64_t since) { m_since = since; }
+
+    void post(uint64_t due)
+    {
+        auto lock = lock_t { m_mutex };
+
+        if (m_failed)
+            return;
+
+        if (m_writing) {
+            m_pending.push_back(due);
+            return;
+        }
+
+        write(due);
+    }
+
+    void OnWriteDone(bool ok) override
+    {
+        auto lock = lock_t { m_mutex };
+
+        if (m_write.msg() == "0xFEE1DEAD")
+            m_ready++;
+
+        m_writing = false;
+
+        if (!ok) {
+            m_failed = true;
+            return;
+        }
+
+        if (m_pending.empty())
+            return;
+
+        auto due = m_pending.front();
+        m_pending.pop_front();
+
+        write(due);
+    }
+
+    void OnReadDone(bool ok) override
+    {
+        if (!ok)
+            return;
+
+        auto now = now_ns();
+        auto due = std::strtoull(m_read.msg().c_str(), nullptr, 10);
+
+        if (due >= m_since && due <= now) {
+            m_latencies.push_back(now - due);
+            m_delivered++;
+            m_last_delivery = now;
+
+            if (m_read.has_trace()) {
+                using google::protobuf::util::TimeUtil;
+
+                auto const& trace = m_read.trace();
+                auto client_send = TimeUtil::TimestampToNanoseconds(trace.client_send());
+                auto server_receive = TimeUtil::TimestampToNanoseconds(trace.server_receive());
+                auto enqueue = TimeUtil::TimestampToNanoseconds(trace.enqueue());
+
+                // Across clocks, so clamped at 0 should they disagree
+                auto elapsed = [](int64_t from, int64_t to) {
+                    return static_cast<uint64_t>(std::max<int64_t>(to - from, 0));
+                };
+
+                m_phases.to_server.push_back(elapsed(client_send, server_receive));
+                m_phases.to_enqueue.push_back(elapsed(server_receive, enqueue));
+                m_phases.to_follower.push_back(elapsed(enqueue, wall_ns()));
+            }
+        }
+
+        StartRead(&m_read);
+    }
+
+    void OnDone(Status const& status) override
+    {
+        auto lock = lock_t { m_mutex };
+
+        m_status = status;
+        m_done = true;
+        m_cv.notify_all();
+    }
+
+    // Cancel the stream; the server sends until the client goes away
+    void close()
+    {
+        m_context.TryCancel();
+    }
+
+    void wait()
+    {
+        auto lock = lock_t { m_mutex };
+        m_cv.wait(lock, [this]() { return m_done; });
+    }
+
+    bool failed()
+    {
+        auto lock = lock_t { m_mutex };
+        return m_failed;
+    }
+
+    std::vector<uint64_t> const& latencies() const { return m_latencies; }
+    Phases const& phases() const { return m_phases; }
+};
+
+/*
+ * Pick who every user follows: `follows` distinct users other than themself, drawn from a power law over the
+ * user ids, so that a few users have most of the followers.
+ *
+ * @return following[i] holds the users user i follows
+ */
+std::vector<std::vector<size_t>> follow_graph(LoadOptions const& options)
+{
+    auto random = std::mt19937 { options.seed };
+    auto weights = std::vector<double>(options.users);
+
+    for (auto i = size_t {}; i < options.users; i++)
+        weights[i] = 1.0 / std::pow(i + 1, options.alpha);
+
+    auto popularity = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    auto following = std::vector<std::vector<size_t>>(options.users);
+    auto follows = std::min(options.follows, options.users - 1);
+
+    for (auto i = size_t {}; i < options.users; i++) {
+        // With a steep power law the same few users come up again and again, so give up after a while
+        for (auto attempt = size_t {}; following[i].size() < follows && attempt < 20 * follows; attempt++) {
+            auto user = popularity(random);
+
+            if (user != i && std::find(following[i].begin(), following[i].end(), user) == following[i].end())
+                following[i].push_back(user);
+        }
+    }
+
+    return following;
+}
+
+// Run f(i) for every i below n on `threads` threads
+template <typename F>
+void parallel_for(size_t n, size_t threads, F&& f)
+{
+    auto next = std::atomic<size_t> {};
+    auto workers = std::vector<std::thread> {};
+
+    for (auto t = size_t {}; t < std::max<size_t>(threads, 1); t++) {
+        workers.emplace_back([&]() {
+            for (auto i = next++; i < n; i = next++)
+                f(i);
+        });
+    }
+
+    for (auto&& worker : workers)
+        worker.join();
+}
+
+// Exact percentile of sorted values
+uint64_t percentile(std::vector<uint64_t> const& sorted, double fraction)
+{
+    if (sorted.empty())
+        return 0;
+
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()))];
+}
+
+int main(int argc, char** argv)
+{
+    auto options = LoadOptions {};
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "h:p:x:n:f:a:m:r:d:w:j:s:")) != -1) {
+        switch (opt) {
+        case 'h':
+            options.hostname = optarg;
+            break;
+        case 'p':
+            options.port = optarg;
+            break;
+        case 'x':
+            options.prefix = optarg;
+            break;
+        case 'n':
+            options.users = std::stoul(optarg);
+            break;
+        case 'f':
+            options.follows = std::stoul(optarg);
+            break;
+        case 'a':
+            options.alpha = std::stod(optarg);
+            break;
+        case 'm':
+            options.streams = std::stoul(optarg);
+            break;
+        case 'r':
+            options.rate = std::stod(optarg);
+            break;
+        case 'd':
+            options.seconds = std::stod(optarg);
+            break;
+        case 'w':
+            options.drain = std::stod(optarg);
+            break;
+        case 'j':
+            options.threads = std::stoul(optarg);
+            break;
+        case 's':
+            options.seed = std::stoul(optarg);
+            break;
+        default:
+            std::cerr << "Invalid Command Line Argument\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.users < 2 || !options.streams || options.rate <= 0) {
+        std::cerr << "Need at least 2 users, 1 stream and a positive rate\n";
+        return EXIT_FAILURE;
+    }
+
+    options.streams = std::min(options.streams, options.users);
+
+    auto channel = grpc::CreateChannel(options.hostname + ':' + options.port, grpc::InsecureChannelCredentials());
+    auto stub = SNSService::NewStub(channel);
+    auto name = [&](size_t i) { return options.prefix + std::to_string(i); };
+
+    // Register every user, then all the follows of each user in one Follow
+    auto following = follow_graph(options);
+    auto populate_start = std::chrono::steady_clock::now();
+    auto failures = std::atomic<size_t> {};
+
+    std::cerr << "registering " << options.users << " users\n";
+
+    parallel_for(options.users, options.threads, [&](size_t i) {
+        auto context = ClientContext {};
+        auto request = Request {};
+        auto reply = Reply {};
+
+        request.set_username(name(i));
+
+        if (!stub->Login(&context, request, &reply).ok())
+            failures++;
+    });
+
+    parallel_for(options.users, options.threads, [&](size_t i) {
+        auto context = ClientContext {};
+        auto request = Request {};
+        auto reply = Reply {};
+
+        request.set_username(name(i));
+
+        for (auto user : following[i])
+            request.add_arguments(name(user));
+
+        if (!stub->Follow(&context, request, &reply).ok())
+            failures++;
+    });
+
+    auto populate_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - populate_start).count();
+
+    if (failures) {
+        std::cerr << failures << " Login or Follow calls failed, is tsd running on port " << options.port << "?\n";
+        return EXIT_FAILURE;
+    }
+
+    // Streams go to a random sample of users, so they get a mix of popular and unpopular ones
+    auto random = std::mt19937 { options.seed };
+    auto order = std::vector<size_t>(options.users);
+
+    for (auto i = size_t {}; i < options.users; i++)
+        order[i] = i;
+
+    std::shuffle(order.begin(), order.end(), random);
+    order.resize(options.streams);
+
+    // Deliveries each post should make: the followers of its sender that have a stream
+    auto has_stream = std::vector<bool>(options.users);
+    auto fanout = std::vector<uint64_t>(options.users);
+    auto edges = size_t {};
+    auto max_followers = size_t {};
+    auto followers = std::vector<size_t>(options.users);
+
+    for (auto user : order)
+        has_stream[user] = true;
+
+    for (auto i = size_t {}; i < options.users; i++) {
+        edges += following[i].size();
+
+        for (auto user : following[i]) {
+            max_followers = std::max(max_followers, ++followers[user]);
+
+            if (has_stream[i])
+                fanout[user]++;
+        }
+    }
+
+    std::cerr << "opening " << options.streams << " timeline streams\n";
+
+    auto ready = std::atomic<size_t> {};
+    auto delivered = std::atomic<uint64_t> {};
+    auto last_delivery = std::atomic<uint64_t> {};
+    auto streams = std::vector<std::unique_ptr<Stream>> {};
+
+    for (auto user : order)
+        streams.push_back(std::make_unique<Stream>(stub.get(), name(user), ready, delivered, last_delivery));
+
+    while (ready < streams.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+
+    // [IMPORTANT] Presumption is that the server registers a stream shortly after its magic string was written;
+    // posts to a stream not yet registered are not delivered to it and show up as missing deliveries
+    std::this_thread::sleep_for(std::chrono::milliseconds { 500 });
+
+    std::cerr << "posting " << options.rate << " posts/s for " << options.seconds << "s\n";
+
+    // Each post is due at a fixed time and latency is measured from then, so a server that falls behind is not
+    // hidden by the posting loop slowing down with it
+    auto posts = static_cast<uint64_t>(options.rate * options.seconds);
+    auto interval = 1e9 / options.rate;
+    auto expected = uint64_t {};
+    auto start = now_ns() + 1000000;
+
+    for (auto&& stream : streams)
+        stream->measure(start);
+
+    for (auto i = uint64_t {}; i < posts; i++) {
+        auto due = start + static_cast<uint64_t>(i * interval);
+        auto sender = i % streams.size();
+
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point { std::chrono::nanoseconds { due } });
+
+        streams[sender]->post(due);
+        expected += fanout[order[sender]];
+    }
+
+    auto posted = now_ns();
+
+    // Wait for the deliveries still in flight
+    auto deadline = posted + static_cast<uint64_t>(options.drain * 1e9);
+
+    while (delivered < expected && now_ns() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+
+    auto failed = size_t {};
+
+    for (auto&& stream : streams) {
+        failed += stream->failed();
+        stream->close();
+    }
+
+    auto latencies = std::vector<uint64_t> {};
+    auto phases = Phases {};
+
+    auto merge = [](std::vector<uint64_t>& to, std::vector<uint64_t> const& from) {
+        to.insert(to.end(), from.begin(), from.end());
+    };
+
+    for (auto&& stream : streams) {
+        stream->wait();
+        merge(latencies, stream->latencies());
+        merge(phases.to_server, stream->phases().to_server);
+        merge(phases.to_enqueue, stream->phases().to_enqueue);
+        merge(phases.to_follower, stream->phases().to_follower);
+    }
+
+    for (auto* values : { &latencies, &phases.to_server, &phases.to_enqueue, &phases.to_follower })
+        std::sort(values->begin(), values->end());
+
+    auto post_seconds = (posted - start) / 1e9;
+    auto delivery_seconds = (std::max(last_delivery.load(), posted) - start) / 1e9;
+    auto sum = uint64_t {};
+
+    for (auto latency : latencies)
+        sum += latency;
+
+    auto us = [](uint64_t ns) { return ns / 1e3; };
+
+    printf("{\n");
+    printf("  \"users\": %zu,\n", options.users);
+    printf("  \"follows\": %zu,\n", options.follows);
+    printf("  \"alpha\": %g,\n", options.alpha);
+    printf("  \"edges\": %zu,\n", edges);
+    printf("  \"max_followers\": %zu,\n", max_followers);
+    printf("  \"streams\": %zu,\n", options.streams);
+    printf("  \"failed_streams\": %zu,\n", failed);
+    printf("  \"target_rate\": %g,\n", options.rate);
+    printf("  \"populate_seconds\": %.3f,\n", populate_seconds);
+    printf("  \"posts\": %llu,\n", static_cast<unsigned long long>(posts));
+    printf("  \"post_rate\": %.1f,\n", posts / post_seconds);
+    printf("  \"deliveries_expected\": %llu,\n", static_cast<unsigned long long>(expected));
+    printf("  \"deliveries\": %zu,\n", latencies.size());
+    printf("  \"delivery_rate\": %.1f,\n", latencies.size() / delivery_seconds);
+    printf("  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+           "\"max\": %.1f}",
+           latencies.empty() ? 0 : us(sum) / latencies.size(), us(percentile(latencies, 0.50)),
+           us(percentile(latencies, 0.90)), us(percentile(latencies, 0.99)), us(percentile(latencies, 0.999)),
+           us(latencies.empty() ? 0 : latencies.back()));
+
+    // Empty if the server does not fill in traces
+    printf(",\n  \"phases_us\": {");
+
+    auto phase = [&](char const* name, std::vector<uint64_t> const& values, char const* separator) {
+        printf("\n    \"%s\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s", name,
+               us(percentile(values, 0.50)), us(percentile(values, 0.90)), us(percentile(values, 0.99)),
+               us(values.empty() ? 0 : values.back()), separator);
+    };
+
+    phase("to_server", phases.to_server, ",");
+    phase("to_enqueue", phases.to_enqueue, ",");
+    phase("to_follower", phases.to_follower, "");
+
+    printf("\n  }");
+
+    // The server's own view, since it started, see Stats in sns.proto
+    auto context = ClientContext {};
+    auto stats = StatsReply {};
+
+    if (stub->Stats(&context, StatsRequest {}, &stats).ok()) {
+        printf(",\n  \"server\": {\n");
+
+        for (auto i = 0; i < stats.histograms_size(); i++) {
+            auto const& histogram = stats.histograms(i);
+
+            printf("    \"%s\": {\"unit\": \"%s\", \"count\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+                   "\"max\": %llu},\n",
+                   histogram.name().c_str(), histogram.unit().c_str(),
+                   static_cast<unsigned long long>(histogram.count()), static_cast<unsigned long long>(histogram.p50()),
+                   static_cast<unsigned long long>(histogram.p90()), static_cast<unsigned long long>(histogram.p99()),
+                   static_cast<unsigned long long>(histogram.max()));
+        }
+
+        printf("    \"bytes_written\": %llu,\n", static_cast<unsigned long long>(stats.bytes_written()));
+        printf("    \"dropped\": %llu\n", static_cast<unsigned long long>(stats.dropped()));
+        printf("  }");
+    }
+
+    printf("\n}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <grpc++/grpc++.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include "sns.grpc.pb.h"
+#include "trace.h"
+
+// What an outbound queue does with a new message when it is full
+enum class OverflowPolicy {
+    DROP_OLDEST, // Make room by dropping the oldest queued message
+    DROP_NEWEST, // Drop the new message
+    DISCONNECT   // Cancel the stream; the client has fallen too far behind
+};
+
+struct OutboundStats {
+    uint64_t queued;      // Messages accepted into a queue
+    uint64_t sent;        // Messages written to a stream
+    uint64_t dropped;     // Messages dropped because a queue was full
+    uint64_t disconnects; // Streams cancelled because their queue was full
+    uint64_t depth;       // Messages currently queued across all streams
+    uint64_t max_depth;   // High-water mark of any single queue
+};
+
+/*
+ * Bounded queue of messages waiting to be written to one timeline stream.
+ *
+ * Messages are queued serialized, see serialize(): a post is encoded once however many streams it is written to,
+ * and every queue holds a reference to the same bytes.
+ *
+ * Posts are pushed by whichever thread fans them out. The queue has at most one write in flight on the stream's
+ * reactor and starts the next one from written(), so a slow client only ever delays its own stream and an idle
+ * stream holds no thread. The queue holds at most capacity messages; what happens beyond that is decided by
+ * the overflow policy.
+ *
+ * The queue also finishes the stream, see close(), since that may only happen once no write is in flight.
+ */
+class OutboundQueue {
+private:
+    using Reactor = grpc::ServerBidiReactor<grpc::ByteBuffer, grpc::ByteBuffer>;
+
+    // A queued message, and the trace of its delivery to this stream if the post is traced
+    struct Entry {
+        grpc::ByteBuffer message;
+        std::shared_ptr<PostTrace> trace;
+        size_t delivery;
+    };
+
+    std::string m_name;
+    Reactor* m_reactor;
+    grpc::CallbackServerContext* m_context;
+    size_t m_capacity;
+    OverflowPolicy m_policy;
+
+    std::mutex m_mutex;
+    std::deque<Entry> m_queue;
+    // Message being written, held until its write completes
+    Entry m_current;
+    bool m_writing;
+    // Set once no more messages are accepted, see closed()
+    std::atomic<bool> m_closed;
+    // Cancel the stream once the write in flight completes
+    bool m_cancel;
+    // Finish the stream with m_status once the write in flight completes
+    bool m_finishing;
+    bool m_finished;
+    grpc::Status m_status;
+
+    uint64_t m_sent;
+    uint64_t m_dropped;
+    size_t m_max_depth;
+
+    // Totals across every queue
+    static inline std::atomic<uint64_t> s_queued {};
+    static inline std::atomic<uint64_t> s_sent {};
+    static inline std::atomic<uint64_t> s_dropped {};
+    static inline std::atomic<uint64_t> s_disconnects {};
+    static inline std::atomic<uint64_t> s_depth {};
+    static inline std::atomic<uint64_t> s_max_depth {};
+
+    void report()
+    {
+        if (m_dropped)
+            std::cerr << "timeline stream of " << m_name << ": sent " << m_sent << ", dropped " << m_dropped
+                      << ", max queue depth " << m_max_depth << '\n';
+    }
+
+public:
+    OutboundQueue(std::string name, Reactor* reactor, grpc::CallbackServerContext* context, size_t capacity,
+                  OverflowPolicy policy)
+        : m_name(name)
+        , m_reactor(reactor)
+        , m_context(context)
+        , m_capacity(std::max<size_t>(capacity, 1))
+        , m_policy(policy)
+        , m_writing(false)
+        , m_closed(false)
+        , m_cancel(false)
+        , m_finishing(false)
+        , m_finished(false)
+        , m_sent(0)
+        , m_dropped(0)
+        , m_max_depth(0)
+    {
+    }
+
+    /*
+     * Encode a message for push(), once for every stream it goes to
+     *
+     * @return the message's bytes; copies share them
+     */
+    static grpc::ByteBuffer serialize(csce438::Message const& message)
+    {
+        auto bytes = grpc::ByteBuffer {};
+        auto own = false;
+
+        grpc::SerializationTraits<csce438::Message>::Serialize(message, &bytes, &own);
+
+        return bytes;
+    }
+
+    /*
+     * Queue a message to be written to the stream
+     *
+     * @parameter message   the message as serialize() encodes it
+     * @parameter trace     trace of the post, if it is sampled; records when the message is queued and written
+     *
+     * @return false if the message was not queued, because the queue is full or closed
+     */
+    bool push(grpc::ByteBuffer const& message, std::shared_ptr<PostTrace> const& trace = nullptr)
+    {
+        if (m_closed)
+            return false;
+
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        if (m_closed)
+            return false;
+
+        auto entry = Entry { message, trace, trace ? trace->queued(m_name) : 0 };
+
+        if (!m_writing) {
+            // Nothing in flight, so nothing queued either; write it right away
+            m_writing = true;
+            m_current = std::move(entry);
+
+            if (m_current.trace)
+                m_current.trace->written(m_current.delivery);
+
+            lock.unlock();
+
+            s_queued++;
+            m_reactor->StartWrite(&m_current.message);
+
+            return true;
+        }
+
+        if (m_queue.size() >= m_capacity) {
+            m_dropped++;
+            s_dropped++;
+
+            switch (m_policy) {
+            case OverflowPolicy::DROP_OLDEST:
+                m_queue.pop_front();
+                s_depth--;
+                break;
+            case OverflowPolicy::DROP_NEWEST:
+                return false;
+            case OverflowPolicy::DISCONNECT:
+                // A write is in flight, so written() cancels the stream once it completes
+                m_closed = true;
+                m_cancel = true;
+                s_disconnects++;
+                s_depth -= m_queue.size();
+                m_queue.clear();
+
+                return false;
+            }
+        }
+
+        m_queue.push_back(std::move(entry));
+        m_max_depth = std::max(m_max_depth, m_queue.size());
+
+        auto depth = static_cast<uint64_t>(m_queue.size());
+        auto max_depth = s_max_depth.load();
+
+        while (depth > max_depth && !s_max_depth.compare_exchange_weak(max_depth, depth))
+            ;
+
+        lock.unlock();
+
+        s_queued++;
+        s_depth++;
+
+        return true;
+    }
+
+    /*
+     * Start the next write; called by the stream's reactor from OnWriteDone()
+     *
+     * @parameter ok        whether the last write succeeded
+     */
+    void written(bool ok)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        if (ok) {
+            m_sent++;
+            s_sent++;
+
+            if (m_current.trace)
+                m_current.trace->sent(m_current.delivery);
+        } else if (!m_closed) {
+            // The client went away; make sure the stream is torn down even if it already half-closed
+            m_closed = true;
+            m_cancel = true;
+        }
+
+        if (!m_closed && !m_queue.empty()) {
+            m_current = std::move(m_queue.front());
+            m_queue.pop_front();
+            s_depth--;
+
+            if (m_current.trace)
+                m_current.trace->written(m_current.delivery);
+
+            lock.unlock();
+
+            m_reactor->StartWrite(&m_current.message);
+            return;
+        }
+
+        m_writing = false;
+        m_current = Entry {};
+
+        auto cancel = m_cancel;
+        auto finish = m_finishing && !m_finished;
+
+        m_cancel = false;
+        m_finished = m_finished || finish;
+
+        lock.unlock();
+
+        // Still inside a reaction, so the stream cannot have gone away
+        if (cancel)
+            m_context->TryCancel();
+
+        if (finish) {
+            report();
+            m_reactor->Finish(m_status);
+        }
+    }
+
+    // A queue is closed once its stream is cancelled, fails, or overflows with OverflowPolicy::DISCONNECT
+    bool closed() const
+    {
+        return m_closed;
+    }
+
+    size_t depth()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        return m_queue.size();
+    }
+
+    /*
+     * Stop accepting messages and finish the stream once the write in flight, if any, completes.
+     * Only the stream's reactor calls this, once it will not read from the stream again.
+     */
+    void close(grpc::Status status)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_closed = true;
+        s_depth -= m_queue.size();
+        m_queue.clear();
+
+        if (m_finishing)
+            return;
+
+        m_finishing = true;
+        m_status = status;
+
+        if (m_writing)
+            return;
+
+        m_finished = true;
+
+        lock.unlock();
+
+        report();
+        m_reactor->Finish(status);
+    }
+
+    static OutboundStats stats()
+    {
+        return OutboundStats { s_queued, s_sent, s_dropped, s_disconnects, s_depth, s_max_depth };
+    }
+};
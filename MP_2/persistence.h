@@ -0,0 +1,386 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "snapshot.h"
+#include "stats.h"
+
+// When the persistence thread calls fsync() on the files it has written to
+enum class FsyncPolicy {
+    NONE,     // Leave it to the kernel
+    INTERVAL, // At most once per interval
+    BATCH     // After every group commit
+};
+
+/*
+ * Background persistence pipeline.
+ *
+ * RPC handlers queue their writes and move on; a single thread takes everything queued since its last pass,
+ * coalesces it into one write() per file and fsyncs according to the policy (group commit).
+ * Every queued operation gets a ticket; wait() blocks until the batch containing that ticket has been committed,
+ * for callers that need a change to be durable before they reply.
+ *
+ * Operations on the same file are applied in the order they were queued. Callers queue them while holding
+ * whatever lock orders the corresponding in-memory changes.
+ */
+class Persistence {
+private:
+    struct Operation {
+        // File appended to, or the log reset by a snapshot
+        std::string path;
+        // Bytes to append, or the new log header for a snapshot
+        std::string data;
+        // Bytes to append that other operations share, such as a post logged to every follower; replaces data
+        std::shared_ptr<std::string const> shared;
+        // Set for snapshots; the snapshot is added to the snapshot file under this name before the log is reset
+        std::string name;
+        std::string snapshot;
+
+        std::string const& bytes() const { return shared ? *shared : data; }
+    };
+
+    SnapshotFile& m_snapshots;
+    FsyncPolicy m_policy;
+    std::chrono::milliseconds m_interval;
+
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::condition_variable m_committed;
+    std::vector<Operation> m_queue;
+    uint64_t m_queued;
+    uint64_t m_commit;
+    bool m_stop;
+
+    // Only accessed by the persistence thread
+    std::unordered_map<std::string, int> m_files;
+    std::unordered_set<std::string> m_dirty;
+    std::chrono::steady_clock::time_point m_last_fsync;
+
+    std::thread m_writer;
+
+    // Every user has a log, so files are only kept open up to a limit
+    static constexpr size_t MAX_OPEN_FILES = 1024;
+
+    int file(std::string const& path)
+    {
+        auto it = m_files.find(path);
+
+        if (it != m_files.end())
+            return it->second;
+
+        if (m_files.size() >= MAX_OPEN_FILES)
+            close_files();
+
+        auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+            perror(("open(): " + path).c_str());
+
+        return m_files[path] = fd;
+    }
+
+    static void write_all(int fd, std::string const& data)
+    {
+        auto cursor = data.data();
+        auto remaining = data.size();
+
+        while (remaining) {
+            auto bytes = ::write(fd, cursor, remaining);
+
+            if (bytes < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                perror("write(): persistence");
+                return;
+            }
+
+            cursor += bytes;
+            remaining -= bytes;
+        }
+    }
+
+    void flush(std::string const& path, std::string& buffer)
+    {
+        if (buffer.empty())
+            return;
+
+        auto fd = file(path);
+
+        if (fd >= 0) {
+            write_all(fd, buffer);
+            m_dirty.insert(path);
+        }
+
+        buffer.clear();
+    }
+
+    void reset_log(Operation const& snapshot)
+    {
+        // Start a new log, which only applies to the snapshot just written
+        auto it = m_files.find(snapshot.path);
+
+        if (it != m_files.end()) {
+            if (it->second >= 0)
+                close(it->second);
+
+            m_files.erase(it);
+        }
+
+        if (m_files.size() >= MAX_OPEN_FILES)
+            close_files();
+
+        auto log = open(snapshot.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+
+        if (log < 0)
+            perror(("open(): " + snapshot.path).c_str());
+        else
+            write_all(log, snapshot.data);
+
+        m_files[snapshot.path] = log;
+        m_dirty.insert(snapshot.path);
+    }
+
+    void commit(std::vector<Operation>& batch)
+    {
+        // Group operations by file, keeping their order within each file
+        auto order = std::vector<std::string> {};
+        auto files = std::unordered_map<std::string, std::vector<Operation*>> {};
+
+        for (auto&& operation : batch) {
+            auto& operations = files[operation.path];
+
+            if (operations.empty())
+                order.push_back(operation.path);
+
+            operations.push_back(&operation);
+        }
+
+        // Logs to restart once the snapshots are durable, with the appends queued after their snapshot
+        auto resets = std::vector<std::pair<Operation*, std::string>> {};
+
+        for (auto&& path : order) {
+            auto& operations = files[path];
+            auto buffer = std::string {};
+            auto snapshot = std::find_if(operations.rbegin(), operations.rend(), [](Operation* operation) {
+                return !operation->name.empty();
+            });
+
+            // Coalesce the appends into a single write()
+            if (snapshot == operations.rend()) {
+                for (auto* operation : operations)
+                    buffer += operation->bytes();
+
+                flush(path, buffer);
+                continue;
+            }
+
+            // Appends queued before the first snapshot still go to the current log, so that it stays complete
+            // if we crash before the snapshot is durable. Anything up to the last snapshot is part of it.
+            for (auto* operation : operations) {
+                if (!operation->name.empty())
+                    break;
+
+                buffer += operation->bytes();
+            }
+
+            flush(path, buffer);
+
+            m_snapshots.append((*snapshot)->name, (*snapshot)->snapshot);
+
+            for (auto it = snapshot.base(); it != operations.end(); it++)
+                buffer += (*it)->bytes();
+
+            resets.emplace_back(*snapshot, std::move(buffer));
+        }
+
+        // A snapshot must be durable before the log it replaces is thrown away; one fsync() covers the batch
+        if (!resets.empty() && m_policy != FsyncPolicy::NONE)
+            fsync(m_snapshots.fd());
+
+        for (auto&& [snapshot, buffer] : resets) {
+            reset_log(*snapshot);
+            flush(snapshot->path, buffer);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (m_policy == FsyncPolicy::BATCH || (m_policy == FsyncPolicy::INTERVAL && now - m_last_fsync >= m_interval))
+            sync();
+    }
+
+    void sync()
+    {
+        for (auto&& path : m_dirty) {
+            auto it = m_files.find(path);
+
+            if (it != m_files.end() && it->second >= 0)
+                fsync(it->second);
+        }
+
+        m_dirty.clear();
+        m_last_fsync = std::chrono::steady_clock::now();
+    }
+
+    void close_files()
+    {
+        // Sync before closing, or the policy's fsync() would be lost with the file descriptor
+        if (m_policy != FsyncPolicy::NONE)
+            sync();
+
+        m_dirty.clear();
+
+        for (auto&& [path, fd] : m_files)
+            if (fd >= 0)
+                close(fd);
+
+        m_files.clear();
+    }
+
+    void run()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto batch = std::vector<Operation> {};
+
+        while (true) {
+            // Wake up at least once per interval so INTERVAL fsyncs are not left pending
+            m_ready.wait_for(lock, m_interval, [this]() { return m_stop || !m_queue.empty(); });
+
+            // Group commit: take everything queued since the last pass
+            batch.swap(m_queue);
+
+            auto ticket = m_queued;
+            auto stop = m_stop;
+
+            lock.unlock();
+
+            if (!batch.empty()) {
+                auto start = std::chrono::steady_clock::now();
+                auto bytes = uint64_t {};
+
+                for (auto&& operation : batch)
+                    bytes += operation.bytes().size() + operation.snapshot.size();
+
+                commit(batch);
+
+                Metrics::instance().commit.record_since(start);
+                Metrics::instance().bytes_written += bytes;
+            } else if (m_policy == FsyncPolicy::INTERVAL && !m_dirty.empty()) {
+                sync();
+            }
+
+            batch.clear();
+
+            lock.lock();
+
+            m_commit = ticket;
+            m_committed.notify_all();
+
+            if (stop && m_queue.empty())
+                return;
+        }
+    }
+
+    uint64_t queue(Operation&& operation)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        // The writer takes the whole queue at once, so only an empty queue needs a wake up
+        auto wake = m_queue.empty();
+
+        m_queue.push_back(std::move(operation));
+
+        auto ticket = ++m_queued;
+
+        lock.unlock();
+
+        if (wake)
+            m_ready.notify_one();
+
+        return ticket;
+    }
+
+public:
+    /*
+     * @parameter snapshots     snapshot file, which is only written by the persistence thread from now on
+     * @parameter policy        when to fsync() written files
+     * @parameter interval      for FsyncPolicy::INTERVAL
+     */
+    Persistence(SnapshotFile& snapshots, FsyncPolicy policy, std::chrono::milliseconds interval = std::chrono::milliseconds { 1000 })
+        : m_snapshots(snapshots)
+        , m_policy(policy)
+        , m_interval(interval)
+        , m_queued(0)
+        , m_commit(0)
+        , m_stop(false)
+        , m_last_fsync(std::chrono::steady_clock::now())
+    {
+        m_writer = std::thread(&Persistence::run, this);
+    }
+
+    ~Persistence()
+    {
+        // Commit whatever is still queued before closing the files
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_stop = true;
+        lock.unlock();
+
+        m_ready.notify_one();
+        m_writer.join();
+
+        close_files();
+    }
+
+    /*
+     * Queue bytes to be appended to a file
+     *
+     * @return ticket to wait() on
+     */
+    uint64_t append(std::string path, std::string data)
+    {
+        return queue(Operation { std::move(path), std::move(data), nullptr, {}, {} });
+    }
+
+    /*
+     * Queue bytes to be appended to a file without copying them, for bytes appended to many files
+     *
+     * @return ticket to wait() on
+     */
+    uint64_t append(std::string path, std::shared_ptr<std::string const> data)
+    {
+        return queue(Operation { std::move(path), {}, std::move(data), {}, {} });
+    }
+
+    /*
+     * Queue a snapshot to be added to the snapshot file under name, after which the log at log_path is
+     * truncated and restarted with header. Appends to log_path queued before the snapshot are still written first.
+     *
+     * @return ticket to wait() on
+     */
+    uint64_t snapshot(std::string name, std::string contents, std::string log_path, std::string header)
+    {
+        return queue(Operation { std::move(log_path), std::move(header), nullptr, std::move(name), std::move(contents) });
+    }
+
+    // Block until the operation with the given ticket has been committed
+    void wait(uint64_t ticket)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_committed.wait(lock, [this, ticket]() { return m_commit >= ticket; });
+    }
+};
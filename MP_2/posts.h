@@ -0,0 +1,175 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "sns.grpc.pb.h"
+
+// A post is shared by every timeline, outbox and stream queue it is in, and never changes once interned
+using Post = std::shared_ptr<csce438::Message const>;
+
+struct PostStats {
+    uint64_t posts;      // Posts currently stored
+    uint64_t references; // Timeline, outbox and queue entries referring to them
+    uint64_t bytes;      // Memory held by the posts
+    uint64_t copy_bytes; // Memory the same entries would take as copies of the posts
+};
+
+/*
+ * Table of every post in memory, so that each is stored once however many timelines it is in.
+ *
+ * Posts are looked up by content: a post read back from several users' snapshots or logs is the same post
+ * and interned to the same object. The table only holds weak references; a post is dropped from it as soon as
+ * the last timeline referring to it lets go.
+ *
+ * A post is allocated along with its reference count. Posts outlive any request, so they are not kept in
+ * protobuf arenas: an arena's bookkeeping needs a first block of 320 bytes, twice what a post takes on the heap.
+ */
+class PostTable {
+private:
+    // A post, allocated together with its reference count by std::make_shared()
+    struct Stored {
+        PostTable* table;
+        size_t hash;
+        csce438::Message message;
+
+        Stored(PostTable* table, size_t hash, csce438::Message const& message)
+            : table(table)
+            , hash(hash)
+            , message(message)
+        {
+        }
+
+        ~Stored() { table->release(hash, &message); }
+    };
+
+    struct Entry {
+        std::weak_ptr<csce438::Message const> post;
+        // Identifies the entry once the post has expired
+        csce438::Message const* message;
+        size_t bytes;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_multimap<size_t, Entry> posts;
+    };
+
+    static constexpr size_t SHARDS = 64;
+
+    std::array<Shard, SHARDS> m_shards;
+    std::atomic<uint64_t> m_posts;
+    std::atomic<uint64_t> m_bytes;
+
+    static size_t hash(csce438::Message const& message)
+    {
+        auto hash = std::hash<std::string> {}(message.username());
+
+        hash = hash * 31 + std::hash<std::string> {}(message.msg());
+        hash = hash * 31 + std::hash<int64_t> {}(message.timestamp().seconds());
+        hash = hash * 31 + std::hash<int32_t> {}(message.timestamp().nanos());
+
+        return hash;
+    }
+
+    static bool same(csce438::Message const& a, csce438::Message const& b)
+    {
+        return a.username() == b.username() && a.timestamp().seconds() == b.timestamp().seconds()
+            && a.timestamp().nanos() == b.timestamp().nanos() && a.msg() == b.msg();
+    }
+
+    void release(size_t hash, csce438::Message const* message)
+    {
+        auto& shard = m_shards[hash % SHARDS];
+        auto lock = std::unique_lock<std::mutex>(shard.mutex);
+        auto [begin, end] = shard.posts.equal_range(hash);
+
+        for (auto it = begin; it != end; it++) {
+            if (it->second.message == message) {
+                m_posts--;
+                m_bytes -= it->second.bytes;
+                shard.posts.erase(it);
+                break;
+            }
+        }
+    }
+
+public:
+    PostTable()
+        : m_posts(0)
+        , m_bytes(0)
+    {
+    }
+
+    static PostTable& instance()
+    {
+        static auto table = PostTable {};
+        return table;
+    }
+
+    // Shared post with the same content as message; message is left as it was, so callers can reuse it
+    Post intern(csce438::Message const& message)
+    {
+        // A trace belongs to one send of a post, and same() does not compare it: a traced post gets an object of
+        // its own, which is neither found by nor counted in the table
+        if (message.has_trace())
+            return std::make_shared<csce438::Message const>(message);
+
+        auto hash = PostTable::hash(message);
+        auto& shard = m_shards[hash % SHARDS];
+
+        // Colliding posts we locked but did not match. One may be the last reference to its post, whose release()
+        // locks the shard, so they are declared before the lock and only dropped once it is unlocked.
+        auto collisions = std::vector<Post> {};
+
+        auto lock = std::unique_lock<std::mutex>(shard.mutex);
+        auto [begin, end] = shard.posts.equal_range(hash);
+
+        for (auto it = begin; it != end; it++) {
+            auto post = it->second.post.lock();
+
+            if (post && same(*post, message))
+                return post;
+
+            if (post)
+                collisions.push_back(std::move(post));
+        }
+
+        auto stored = std::make_shared<Stored>(this, hash, message);
+
+        // Shares ownership of the whole allocation, but points at the message in it
+        auto post = Post(stored, &stored->message);
+        auto bytes = sizeof(Stored) - sizeof(csce438::Message) + stored->message.SpaceUsedLong();
+
+        shard.posts.emplace(hash, Entry { post, &stored->message, bytes });
+        m_posts++;
+        m_bytes += bytes;
+
+        return post;
+    }
+
+    // Walks every post, so it is meant for occasional reporting
+    PostStats stats()
+    {
+        auto stats = PostStats { m_posts, 0, m_bytes, 0 };
+
+        for (auto&& shard : m_shards) {
+            auto lock = std::unique_lock<std::mutex>(shard.mutex);
+
+            for (auto&& [hash, entry] : shard.posts) {
+                auto references = static_cast<uint64_t>(entry.post.use_count());
+
+                stats.references += references;
+                stats.copy_bytes += references * entry.bytes;
+            }
+        }
+
+        return stats;
+    }
+};
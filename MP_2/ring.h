@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+/*
+ * Fixed-capacity ring buffer, ordered newest first, in one contiguous allocation made on first use
+ * (most users never post to their outbox).
+ *
+ * push_front() adds the newest element and drops the oldest once the buffer is full, without moving any
+ * other element; push_back() adds an element older than all others, which is how buffers are filled when read
+ * back from disk, and is ignored once the buffer is full.
+ */
+template <typename T>
+class RingBuffer {
+private:
+    std::vector<T> m_data;
+    size_t m_capacity;
+    // Index of the newest element
+    size_t m_head;
+    size_t m_size;
+
+    size_t slot(size_t index) const
+    {
+        return (m_head + index) % m_capacity;
+    }
+
+    void allocate()
+    {
+        if (m_data.empty())
+            m_data.resize(m_capacity);
+    }
+
+public:
+    class const_iterator {
+    private:
+        RingBuffer const* m_ring;
+        size_t m_index;
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T const*;
+        using reference = T const&;
+
+        const_iterator(RingBuffer const* ring, size_t index)
+            : m_ring(ring)
+            , m_index(index)
+        {
+        }
+
+        reference operator*() const { return (*m_ring)[m_index]; }
+        pointer operator->() const { return &(*m_ring)[m_index]; }
+
+        const_iterator& operator++()
+        {
+            m_index++;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            auto copy = *this;
+            m_index++;
+            return copy;
+        }
+
+        bool operator==(const_iterator const& other) const { return m_index == other.m_index; }
+        bool operator!=(const_iterator const& other) const { return m_index != other.m_index; }
+    };
+
+    RingBuffer(size_t capacity)
+        : m_capacity(std::max<size_t>(capacity, 1))
+        , m_head(0)
+        , m_size(0)
+    {
+    }
+
+    void push_front(T value)
+    {
+        allocate();
+
+        m_head = (m_head + m_capacity - 1) % m_capacity;
+        m_data[m_head] = std::move(value);
+
+        if (m_size < m_capacity)
+            m_size++;
+    }
+
+    void push_back(T value)
+    {
+        if (m_size == m_capacity)
+            return;
+
+        allocate();
+
+        m_data[slot(m_size)] = std::move(value);
+        m_size++;
+    }
+
+    // The index-th newest element
+    T const& operator[](size_t index) const { return m_data[slot(index)]; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, m_size); }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return !m_size; }
+};
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Binary snapshot of every user, kept in a single file so that startup maps one file instead of parsing one per user.
+ *
+ * The file is a header followed by length-prefixed records, each holding the snapshot of one user. Snapshotting a
+ * user appends a new record, which supersedes any earlier record of the same user; once superseded records make up
+ * most of the file it is rewritten with only the latest record of each user.
+ *
+ * File:   "TSDS" | u32 version | records
+ * Record: u32 size (of the rest of the record) | u16 name length | name | payload, a torn final record is ignored
+ *
+ * The payload is opaque here; see User::snapshot(). put()/get() are the helpers used to build and read it.
+ * All integers are stored in host byte order; the file is not meant to move between machines.
+ */
+class SnapshotFile {
+public:
+    struct Record {
+        std::string name;
+        char const* data;
+        size_t size;
+        // Holds the payload when it is not in the mapped file, see records()
+        std::shared_ptr<std::string const> copy;
+    };
+
+private:
+    static constexpr char MAGIC[4] = { 'T', 'S', 'D', 'S' };
+    static constexpr uint32_t VERSION = 1;
+
+    struct Location {
+        off_t offset; // Of the payload
+        uint32_t size;
+    };
+
+    std::string m_path;
+    int m_fd;
+    off_t m_size;
+
+    // Guards the index and file descriptor between the persistence thread and read()
+    std::mutex m_mutex;
+
+    // Latest record of every user
+    std::unordered_map<std::string, Location> m_index;
+    size_t m_live;
+
+    // The file as it was opened; stays mapped (and valid) even after the file is rewritten
+    char const* m_map;
+    size_t m_map_size;
+    // Whether the offsets in m_index are still those of the mapped file, that is until the first rewrite()
+    bool m_mapped;
+
+    void index(char const* data, size_t size)
+    {
+        auto cursor = data + sizeof(MAGIC) + sizeof(VERSION);
+        auto end = data + size;
+
+        m_size = cursor - data;
+
+        while (cursor < end) {
+            auto length = uint32_t {};
+            auto name_length = uint16_t {};
+
+            if (!get(cursor, end, length) || end - cursor < length)
+                break;
+
+            auto next = cursor + length;
+
+            if (!get(cursor, next, name_length) || next - cursor < name_length)
+                break;
+
+            auto name = std::string(cursor, name_length);
+            cursor += name_length;
+
+            auto& location = m_index[name];
+
+            if (location.size)
+                m_live -= location.size + frame(name);
+
+            location = Location { cursor - data, static_cast<uint32_t>(next - cursor) };
+            m_live += location.size + frame(name);
+
+            cursor = next;
+            m_size = cursor - data;
+        }
+    }
+
+    static size_t frame(std::string const& name)
+    {
+        return sizeof(uint32_t) + sizeof(uint16_t) + name.size();
+    }
+
+    static std::string header()
+    {
+        auto data = std::string(MAGIC, sizeof(MAGIC));
+        put(data, VERSION);
+
+        return data;
+    }
+
+    static std::string encode(std::string const& name, char const* payload, size_t size)
+    {
+        auto record = std::string {};
+
+        put(record, static_cast<uint32_t>(sizeof(uint16_t) + name.size() + size));
+        put(record, static_cast<uint16_t>(name.size()));
+        record += name;
+        record.append(payload, size);
+
+        return record;
+    }
+
+    static bool write_all(int fd, std::string const& data)
+    {
+        auto cursor = data.data();
+        auto remaining = data.size();
+
+        while (remaining) {
+            auto bytes = ::write(fd, cursor, remaining);
+
+            if (bytes < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                perror("write(): snapshot");
+                return false;
+            }
+
+            cursor += bytes;
+            remaining -= bytes;
+        }
+
+        return true;
+    }
+
+public:
+    SnapshotFile(std::string path)
+        : m_path(path)
+        , m_fd(-1)
+        , m_size(0)
+        , m_live(0)
+        , m_map(nullptr)
+        , m_map_size(0)
+        , m_mapped(true)
+    {
+    }
+
+    ~SnapshotFile()
+    {
+        if (m_map)
+            munmap(const_cast<char*>(m_map), m_map_size);
+
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+
+    template <typename T>
+    static void put(std::string& data, T value)
+    {
+        data.append(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    static void put(std::string& data, std::string const& value)
+    {
+        put(data, static_cast<uint32_t>(value.size()));
+        data += value;
+    }
+
+    template <typename T>
+    static bool get(char const*& cursor, char const* end, T& value)
+    {
+        if (end - cursor < static_cast<ptrdiff_t>(sizeof(T)))
+            return false;
+
+        memcpy(&value, cursor, sizeof(T));
+        cursor += sizeof(T);
+
+        return true;
+    }
+
+    static bool get(char const*& cursor, char const* end, std::string& value)
+    {
+        auto length = uint32_t {};
+
+        if (!get(cursor, end, length) || end - cursor < length)
+            return false;
+
+        value.assign(cursor, length);
+        cursor += length;
+
+        return true;
+    }
+
+    /*
+     * Map the snapshot and index its records, creating the file if it does not exist
+     *
+     * @return false if the file exists but is not a snapshot
+     */
+    bool open()
+    {
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if (m_fd < 0) {
+            perror(("open(): " + m_path).c_str());
+            return false;
+        }
+
+        struct stat info {};
+        fstat(m_fd, &info);
+
+        if (!info.st_size) {
+            write_all(m_fd, header());
+            m_size = sizeof(MAGIC) + sizeof(VERSION);
+            return true;
+        }
+
+        auto* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, m_fd, 0);
+
+        if (data == MAP_FAILED) {
+            perror(("mmap(): " + m_path).c_str());
+            return false;
+        }
+
+        m_map = static_cast<char const*>(data);
+        m_map_size = info.st_size;
+
+        auto version = uint32_t {};
+        auto cursor = m_map + sizeof(MAGIC);
+
+        if (m_map_size < sizeof(MAGIC) || memcmp(m_map, MAGIC, sizeof(MAGIC))
+            || !get(cursor, m_map + m_map_size, version) || version != VERSION) {
+            std::fprintf(stderr, "%s is not a supported snapshot\n", m_path.c_str());
+            return false;
+        }
+
+        index(m_map, m_map_size);
+
+        // Drop a torn record so that new records are appended after the last complete one
+        if (m_size != info.st_size && ftruncate(m_fd, m_size) < 0)
+            perror(("ftruncate(): " + m_path).c_str());
+
+        return true;
+    }
+
+    /*
+     * Latest record of every user. Records that are in the file as it was opened point into the mapping, so
+     * at startup this neither copies nor parses them; those appended since, or moved by a rewrite, are read
+     * into a copy the record owns.
+     */
+    std::vector<Record> records()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto records = std::vector<Record> {};
+
+        records.reserve(m_index.size());
+
+        for (auto&& [name, location] : m_index) {
+            if (m_mapped && static_cast<size_t>(location.offset) + location.size <= m_map_size) {
+                records.push_back(Record { name, m_map + location.offset, location.size, nullptr });
+                continue;
+            }
+
+            auto copy = std::make_shared<std::string>(location.size, '\0');
+
+            if (pread(m_fd, &(*copy)[0], location.size, location.offset) != static_cast<ssize_t>(location.size)) {
+                perror(("pread(): " + m_path).c_str());
+                continue;
+            }
+
+            records.push_back(Record { name, copy->data(), location.size, copy });
+        }
+
+        return records;
+    }
+
+    bool empty() const { return m_index.empty(); }
+
+    int fd() const { return m_fd; }
+
+    /*
+     * Read the latest record of a user, including records appended since open()
+     *
+     * @return false if there is no record for name
+     */
+    bool read(std::string const& name, std::string& payload)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto it = m_index.find(name);
+
+        if (it == m_index.end())
+            return false;
+
+        payload.resize(it->second.size);
+
+        if (pread(m_fd, &payload[0], it->second.size, it->second.offset) != static_cast<ssize_t>(it->second.size)) {
+            perror(("pread(): " + m_path).c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    /*
+     * Read the first size bytes of the latest record of a user, such as a header, without reading all of it
+     *
+     * @return false if there is no record for name or it is shorter than size
+     */
+    bool read(std::string const& name, char* data, size_t size)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        auto it = m_index.find(name);
+
+        if (it == m_index.end() || it->second.size < size)
+            return false;
+
+        return pread(m_fd, data, size, it->second.offset) == static_cast<ssize_t>(size);
+    }
+
+    // Append a new record for name, superseding its previous one
+    void append(std::string const& name, std::string const& payload)
+    {
+        auto record = encode(name, payload.data(), payload.size());
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        if (!write_all(m_fd, record))
+            return;
+
+        auto& location = m_index[name];
+
+        if (location.size)
+            m_live -= location.size + frame(name);
+
+        location = Location { static_cast<off_t>(m_size + frame(name)), static_cast<uint32_t>(payload.size()) };
+        m_live += record.size();
+        m_size += record.size();
+
+        // Drop superseded records once they make up most of the file
+        if (m_size > (1 << 20) && static_cast<size_t>(m_size) > 2 * m_live)
+            rewrite();
+    }
+
+private:
+    // Rewrite the file with only the latest record of every user
+    void rewrite()
+    {
+        // [IMPORTANT] Presumption is that m_mutex is locked already
+
+        auto temporary = m_path + ".tmp";
+        auto fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror(("open(): " + temporary).c_str());
+            return;
+        }
+
+        auto data = header();
+        auto index = std::unordered_map<std::string, Location> {};
+        auto payload = std::string {};
+
+        for (auto&& [name, location] : m_index) {
+            payload.resize(location.size);
+
+            if (pread(m_fd, &payload[0], location.size, location.offset) != static_cast<ssize_t>(location.size)) {
+                perror(("pread(): " + m_path).c_str());
+                close(fd);
+                return;
+            }
+
+            index[name] = Location { static_cast<off_t>(data.size() + frame(name)), location.size };
+            data += encode(name, payload.data(), payload.size());
+        }
+
+        // The old file must stay intact until the new one is durable
+        if (!write_all(fd, data) || fsync(fd) < 0) {
+            close(fd);
+            return;
+        }
+
+        close(fd);
+
+        if (rename(temporary.c_str(), m_path.c_str()) < 0) {
+            perror(("rename(): " + temporary).c_str());
+            return;
+        }
+
+        close(m_fd);
+
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+        m_index = std::move(index);
+        m_mapped = false;
+        m_size = data.size();
+        m_live = m_size - sizeof(MAGIC) - sizeof(VERSION);
+
+        if (m_fd < 0)
+            perror(("open(): " + m_path).c_str());
+    }
+};
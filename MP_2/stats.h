@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * Distribution of a metric in power-of-two buckets: bucket 0 counts zeros and bucket i counts values in
+ * [2^(i-1), 2^i). Recording is a few relaxed atomic operations and never takes a lock, so it can stay on in
+ * production; readers see each counter as of some recent moment, not all of them at the same instant.
+ */
+class Histogram {
+public:
+    static constexpr size_t BUCKETS = 64;
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> m_buckets {};
+    std::atomic<uint64_t> m_count {};
+    std::atomic<uint64_t> m_sum {};
+    std::atomic<uint64_t> m_max {};
+
+    static size_t bucket(uint64_t value)
+    {
+        return value ? std::min<size_t>(64 - __builtin_clzll(value), BUCKETS - 1) : 0;
+    }
+
+public:
+    void record(uint64_t value)
+    {
+        m_buckets[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+
+        if (!value)
+            return;
+
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        auto max = m_max.load(std::memory_order_relaxed);
+
+        while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+            ;
+    }
+
+    // Record the time since start, in microseconds
+    void record_since(std::chrono::steady_clock::time_point start)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+
+        record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+    uint64_t max() const { return m_max.load(std::memory_order_relaxed); }
+    uint64_t bucket_count(size_t index) const { return m_buckets[index].load(std::memory_order_relaxed); }
+
+    /*
+     * Upper bound of the bucket holding the given fraction of values, e.g. 0.99 for the 99th percentile
+     *
+     * @parameter zeros values of 0 counted outside the histogram, see LockWaits
+     */
+    uint64_t percentile(double fraction, uint64_t zeros = 0) const
+    {
+        auto target = static_cast<uint64_t>(fraction * (count() + zeros));
+        auto seen = zeros;
+
+        for (auto i = size_t {}; i < BUCKETS; i++) {
+            seen += bucket_count(i);
+
+            if (seen > target)
+                return i ? std::min(max(), (uint64_t { 1 } << i) - 1) : 0;
+        }
+
+        return max();
+    }
+};
+
+/*
+ * Time spent waiting for a lock, in nanoseconds. Only contended acquisitions are recorded in the histogram.
+ * Uncontended ones are most of them, and every thread taking any lock would otherwise bump the same bucket, so
+ * they are counted in per-thread stripes, each on its own cache line, and only added up when read.
+ */
+class LockWaits {
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> count {};
+    };
+
+    static constexpr size_t STRIPES = 64;
+
+    std::array<Stripe, STRIPES> m_uncontended {};
+    Histogram m_contended;
+
+    // Stripe of the calling thread, handed out round-robin when the thread first takes a lock
+    static size_t stripe()
+    {
+        static auto s_next = std::atomic<size_t> {};
+        thread_local auto stripe = s_next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+
+        return stripe;
+    }
+
+public:
+    void uncontended() { m_uncontended[stripe()].count.fetch_add(1, std::memory_order_relaxed); }
+    void contended(uint64_t nanoseconds) { m_contended.record(nanoseconds); }
+
+    uint64_t uncontended_count() const
+    {
+        auto count = uint64_t {};
+
+        for (auto&& stripe : m_uncontended)
+            count += stripe.count.load(std::memory_order_relaxed);
+
+        return count;
+    }
+
+    Histogram const& contended_waits() const { return m_contended; }
+};
+
+// Lock a mutex, recording how long that took; an uncontended lock does not read the clock
+template <typename Lock, typename Mutex>
+Lock timed_lock(Mutex& mutex, LockWaits& waits)
+{
+    auto lock = Lock(mutex, std::try_to_lock);
+
+    if (lock.owns_lock()) {
+        waits.uncontended();
+        return lock;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    lock.lock();
+
+    waits.contended(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+    return lock;
+}
+
+// Metrics of the whole server, see SNSServiceImpl::stats()
+struct Metrics {
+    // Latency of each unary RPC in microseconds, from being handed to the worker pool until its reply
+    Histogram login;
+    Histogram list;
+    Histogram follow;
+    Histogram unfollow;
+    Histogram get_timeline;
+
+    // Latency of a post on a timeline stream in microseconds, from being read until it has fanned out
+    Histogram post;
+    // Followers of the sender of each post
+    Histogram fanout;
+
+    // Group commits of the persistence thread in microseconds, fsync() included, and the bytes they wrote
+    Histogram commit;
+    std::atomic<uint64_t> bytes_written {};
+
+    // Time spent waiting for shard and user locks, in nanoseconds
+    LockWaits shard_lock;
+    LockWaits user_lock;
+
+    static Metrics& instance()
+    {
+        static auto metrics = Metrics {};
+        return metrics;
+    }
+};
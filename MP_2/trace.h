@@ -0,0 +1,196 @@
+#pragma once
+
+#include <google/protobuf/util/time_util.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "sns.grpc.pb.h"
+
+// Wall clock time of a steady clock time point, for the timestamps of a post's Trace
+inline google::protobuf::Timestamp wall_time(std::chrono::steady_clock::time_point time)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - time);
+    auto wall = std::chrono::system_clock::now() - elapsed;
+
+    return google::protobuf::util::TimeUtil::NanosecondsToTimestamp(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wall.time_since_epoch()).count());
+}
+
+/*
+ * Writes sampled traces of posts to trace.log. Only posts whose client asked for a trace are sampled, one in
+ * every `every` of them; 0 turns the log off.
+ */
+class Tracer {
+private:
+    std::atomic<size_t> m_every;
+    std::atomic<uint64_t> m_traced;
+
+    std::mutex m_mutex;
+    FILE* m_file;
+
+    Tracer()
+        : m_every(0)
+        , m_traced(0)
+        , m_file(nullptr)
+    {
+    }
+
+public:
+    static Tracer& instance()
+    {
+        static auto tracer = Tracer {};
+        return tracer;
+    }
+
+    ~Tracer()
+    {
+        if (m_file)
+            fclose(m_file);
+    }
+
+    void sample_every(size_t every)
+    {
+        m_every = every;
+    }
+
+    // Whether to write the trace of the next traced post
+    bool sample()
+    {
+        auto every = m_every.load(std::memory_order_relaxed);
+
+        return every && m_traced.fetch_add(1, std::memory_order_relaxed) % every == 0;
+    }
+
+    void write(std::string const& trace)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        if (m_file == nullptr && (m_file = fopen("trace.log", "a")) == nullptr) {
+            perror("fopen()");
+            m_every = 0;
+            return;
+        }
+
+        // Flushed right away, so the log can be followed while the server runs
+        fwrite(trace.data(), 1, trace.size(), m_file);
+        fflush(m_file);
+    }
+};
+
+/*
+ * Trace of one sampled post through the server: when it was read, handed to post(), done fanning out and
+ * committed, and for every follower in timeline mode when it was queued, when its write started and when that
+ * write completed. The queues the post is in hold a reference, so the trace is written out once the last of them
+ * is done with it. A batch is traced as one post, whose writes are those of its last message.
+ */
+class PostTrace {
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Delivery {
+        std::string follower;
+        clock::time_point queued;
+        clock::time_point written;
+        clock::time_point sent;
+    };
+
+    std::string m_sender;
+    std::string m_text;
+    // More than one for a batch, which is traced as a unit
+    size_t m_posts;
+    // Client send to server receive, on the wall clock, so only as exact as the clocks agree
+    int64_t m_client_ns;
+
+    clock::time_point m_received;
+    clock::time_point m_enqueued;
+    clock::time_point m_fanned_out;
+    clock::time_point m_committed;
+
+    std::mutex m_mutex;
+    // A deque, so that entries stay put while others are added
+    std::deque<Delivery> m_deliveries;
+
+    static std::string since(clock::time_point start, clock::time_point time)
+    {
+        if (time == clock::time_point {})
+            return "-";
+
+        return '+' + std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(time - start).count()) + "us";
+    }
+
+public:
+    // A post read at `received` and about to be handed to post(), or the first traced post of a batch of `posts`
+    PostTrace(csce438::Message const& message, clock::time_point received, size_t posts = 1)
+        : m_sender(message.username())
+        , m_text(message.msg().substr(0, message.msg().find('\n')).substr(0, 32))
+        , m_posts(posts)
+        , m_client_ns(google::protobuf::util::TimeUtil::DurationToNanoseconds(message.trace().server_receive()
+                                                                              - message.trace().client_send()))
+        , m_received(received)
+        , m_enqueued(clock::now())
+    {
+    }
+
+    ~PostTrace()
+    {
+        auto out = std::ostringstream {};
+
+        if (m_posts > 1)
+            out << "batch of " << m_posts << " posts";
+        else
+            out << "post";
+
+        out << " from " << m_sender << " \"" << m_text << "\": client->server " << m_client_ns / 1000
+            << "us, enqueued " << since(m_received, m_enqueued) << ", fanned out " << since(m_received, m_fanned_out)
+            << ", committed " << since(m_received, m_committed) << ", " << m_deliveries.size() << " streams\n";
+
+        for (auto&& delivery : m_deliveries) {
+            out << "  " << delivery.follower << ": queued " << since(m_received, delivery.queued) << ", written "
+                << since(m_received, delivery.written) << ", sent " << since(m_received, delivery.sent);
+
+            if (delivery.sent == clock::time_point {})
+                out << " (dropped)";
+
+            out << '\n';
+        }
+
+        Tracer::instance().write(out.str());
+    }
+
+    void fanned_out() { m_fanned_out = clock::now(); }
+    void committed() { m_committed = clock::now(); }
+
+    /*
+     * The post was queued for a follower's stream
+     *
+     * @return the delivery, to pass to written() and sent()
+     */
+    size_t queued(std::string const& follower)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        m_deliveries.push_back(Delivery { follower, clock::now(), {}, {} });
+
+        return m_deliveries.size() - 1;
+    }
+
+    // The write of a delivery to its stream started
+    void written(size_t delivery)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_deliveries[delivery].written = clock::now();
+    }
+
+    // The write of a delivery to its stream completed
+    void sent(size_t delivery)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_deliveries[delivery].sent = clock::now();
+    }
+};
@@ -3,77 +3,143 @@
 #include <google/protobuf/duration.pb.h>
 #include <google/protobuf/timestamp.pb.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
 #include <deque>
 #include <fstream>
 #include <google/protobuf/util/time_util.h>
 #include <grpc++/grpc++.h>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <shared_mutex>
 #include <stdlib.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "arena.h"
+#include "ids.h"
+#include "outbound.h"
+#include "persistence.h"
+#include "posts.h"
+#include "ring.h"
+#include "snapshot.h"
 #include "sns.grpc.pb.h"
+#include "stats.h"
+#include "workers.h"
 
+using csce438::ListPage;
+using csce438::ListRequest;
 using csce438::Message;
 using csce438::Reply;
 using csce438::Request;
 using csce438::SNSService;
+using csce438::StatsReply;
+using csce438::StatsRequest;
+using csce438::TimelinePage;
+using csce438::TimelineRequest;
 using google::protobuf::Duration;
 using google::protobuf::Timestamp;
+using grpc::ByteBuffer;
+using grpc::CallbackServerContext;
 using grpc::Server;
+using grpc::ServerBidiReactor;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
-using grpc::ServerReader;
-using grpc::ServerReaderWriter;
-using grpc::ServerWriter;
+using grpc::ServerUnaryReactor;
+using grpc::ServerWriteReactor;
 using grpc::Status;
 
 using lock_t = std::unique_lock<std::mutex>;
+using shared_lock_t = std::shared_lock<std::shared_mutex>;
+using exclusive_lock_t = std::unique_lock<std::shared_mutex>;
 
 class User {
 private:
-    std::ofstream m_file;
+    // Generation of the last snapshot; a log only applies to the snapshot of the same generation
+    unsigned long m_generation;
+    // Number of records in the log (<username>.log)
+    size_t m_log_records;
+    // False if the log on disk belongs to an older snapshot and must be restarted before appending to it
+    bool m_log_valid;
 
 public:
+    // Each log record starts with one of these on its own line
+    enum LogRecord : char {
+        FOLLOWER_ADD = 'F',
+        FOLLOWER_REMOVE = 'f',
+        FOLLOWING_ADD = 'G',
+        FOLLOWING_REMOVE = 'g',
+        POST = 'T',
+        OUTBOX_POST = 'O'
+    };
+
+    // Set while the user is queued for compaction, so it is only queued once
+    bool compaction_pending;
+
+    // Ticket of the last write queued for this user, see SNSServiceImpl::append()
+    uint64_t ticket;
+    // Set whenever the user is used, cleared by the eviction clock as it passes
+    std::atomic<bool> referenced;
+    // Estimated memory use as of the last time the eviction clock passed, see memory()
+    size_t footprint;
+
     // These member variables shouldn't be public but I'm too lazy to refactor
 
     std::string username;
-    std::vector<std::string> following;
-    std::vector<std::string> followers;
+    UserId id;
+    // Interned ids of the users followed and following, see UserIds
+    IdSet following;
+    IdSet followers;
+
+    // Messages kept in every timeline and outbox, see -n
+    static inline size_t depth = 20;
 
-    // For each user in following, store their messages in timeline
-    std::deque<csce438::Message> timeline;
+    // For each user in following, store their messages in timeline; posts are shared, see PostTable
+    RingBuffer<Post> timeline;
 
-    // Pointer to bidirectional stream
-    grpc::ServerReaderWriter<Message, Message>* timeline_stream;
-    // Pointer to server context of stream
-    ServerContext* timeline_context;
+    // Posts of a user with many followers are stored once here instead of in every follower's timeline,
+    // and merged into their followers' timelines when those are read, see SNSServiceImpl::timeline()
+    RingBuffer<Post> outbox;
+
+    // Outbound queue of the user's timeline stream, nullptr if not in timeline mode
+    std::shared_ptr<OutboundQueue> timeline_queue;
 
     // Mutex for modifying user data
     std::mutex mutex;
-    // Mutex for timeline stream
-    std::mutex timeline_mutex;
 
     User(std::string username,
-         std::vector<std::string> following,
-         std::vector<std::string> followers,
-         std::deque<csce438::Message> timeline)
-        : username(username)
-        , following(following)
-        , followers(followers)
-        , timeline(timeline)
-        , timeline_stream(nullptr)
-        , timeline_context(nullptr)
-        , mutex({})
-        , timeline_mutex({}) {};
+         IdSet following,
+         IdSet followers,
+         RingBuffer<Post> timeline)
+        : m_generation(0)
+        , m_log_records(0)
+        , m_log_valid(true)
+        , compaction_pending(false)
+        , ticket(0)
+        , referenced(true)
+        , footprint(0)
+        , username(username)
+        , id(UserIds::instance().intern(username))
+        , following(std::move(following))
+        , followers(std::move(followers))
+        , timeline(std::move(timeline))
+        , outbox(depth)
+        , timeline_queue(nullptr)
+        , mutex({}) {};
 
     static std::shared_ptr<User> from_file(std::string username)
     {
-        // Create user object from file
+        // Create user object from the text <username>.usr file used before server.snap
         auto file = std::ifstream(username + ".usr");
 
         if (!file.is_open()) {
@@ -81,15 +147,27 @@ public:
             exit(EXIT_FAILURE);
         }
 
-        auto following = std::vector<std::string> {};
-        auto followers = std::vector<std::string> {};
-        auto timeline = std::deque<csce438::Message> {};
+        auto following = IdSet {};
+        auto followers = IdSet {};
+        auto timeline = RingBuffer<Post>(depth);
+        // Collected and sorted once; inserting edge by edge would be quadratic in the number of followers
+        auto following_ids = std::vector<UserId> {};
+        auto follower_ids = std::vector<UserId> {};
 
         auto stage = 1;
         auto line = std::string {};
+        auto generation = 0ul;
+        // Reused for every message; interning copies it
+        auto message = csce438::Message {};
 
         file >> line;
 
+        // Rest of the first line holds the snapshot generation; files from before the log existed have none
+        std::getline(file, line);
+
+        if (line.find_first_not_of(' ') != std::string::npos)
+            generation = std::stoul(line);
+
         while (std::getline(file, line)) {
             // Magic numbers are used to denote which stage we are in
             if (line == "\x1B\xAD\xFE\xED") {
@@ -110,375 +188,2038 @@ public:
             // Depending on stage, add data
             switch (stage) {
             case 2:
-                followers.push_back(line);
+                follower_ids.push_back(UserIds::instance().intern(line));
                 break;
             case 3:
-                following.push_back(line);
+                following_ids.push_back(UserIds::instance().intern(line));
                 break;
             case 4: {
                 // Read timeline message from file
-                auto message = csce438::Message {};
-
                 message.set_username(line);
 
+                // Messages are stored with their trailing newline, which getline strips
                 std::getline(file, line);
-                message.set_msg(line);
+                message.set_msg(line + '\n');
 
                 std::getline(file, line);
-                auto timestamp = new google::protobuf::Timestamp();
-                google::protobuf::util::TimeUtil::FromString(line, timestamp);
-                message.set_allocated_timestamp(timestamp);
+                google::protobuf::util::TimeUtil::FromString(line, message.mutable_timestamp());
 
-                timeline.push_back(message);
+                timeline.push_back(PostTable::instance().intern(message));
                 break;
             }
             }
         }
 
-        return std::move(std::make_shared<User>(username, following, followers, timeline));
+        followers.assign(std::move(follower_ids));
+        following.assign(std::move(following_ids));
+
+        auto user = std::make_shared<User>(username, following, followers, timeline);
+
+        user->m_generation = generation;
+
+        // Apply everything logged since the snapshot; a log that belongs to an older snapshot is restarted
+        // by the next snapshot, see needs_compaction()
+        user->m_log_valid = user->replay_log();
+
+        return user;
     }
 
-    void verify_timeline_stream()
+    /*
+     * Create user object from its record in server.snap, see snapshot()
+     *
+     * @return nullptr if the record is corrupt
+     */
+    static std::shared_ptr<User> from_snapshot(std::string username, char const* data, size_t size)
+    {
+        auto cursor = data;
+        auto end = data + size;
+
+        auto generation = uint64_t {};
+        auto count = uint32_t {};
+
+        if (!SnapshotFile::get(cursor, end, generation) || !SnapshotFile::get(cursor, end, count))
+            return nullptr;
+
+        // Usernames are stored once in a string table and referred to by index
+        auto strings = std::vector<std::string>(count);
+
+        for (auto&& string : strings)
+            if (!SnapshotFile::get(cursor, end, string))
+                return nullptr;
+
+        auto names = [&](IdSet& list) {
+            auto length = uint32_t {};
+
+            if (!SnapshotFile::get(cursor, end, length) || static_cast<size_t>(end - cursor) < length * sizeof(uint32_t))
+                return false;
+
+            auto ids = std::vector<UserId> {};
+            ids.reserve(length);
+
+            for (auto i = uint32_t {}; i < length; i++) {
+                auto index = uint32_t {};
+                SnapshotFile::get(cursor, end, index);
+
+                if (index >= strings.size())
+                    return false;
+
+                ids.push_back(UserIds::instance().intern(strings[index]));
+            }
+
+            list.assign(std::move(ids));
+
+            return true;
+        };
+
+        // Reused for every message; interning copies it
+        auto message = csce438::Message {};
+
+        auto messages = [&](RingBuffer<Post>& list) {
+            auto length = uint32_t {};
+
+            if (!SnapshotFile::get(cursor, end, length))
+                return false;
+
+            for (auto i = uint32_t {}; i < length; i++) {
+                auto sender = uint32_t {};
+                auto seconds = int64_t {};
+                auto nanos = int32_t {};
+
+                if (!SnapshotFile::get(cursor, end, sender) || sender >= strings.size()
+                    || !SnapshotFile::get(cursor, end, seconds) || !SnapshotFile::get(cursor, end, nanos)
+                    || !SnapshotFile::get(cursor, end, *message.mutable_msg()))
+                    return false;
+
+                message.set_username(strings[sender]);
+                message.mutable_timestamp()->set_seconds(seconds);
+                message.mutable_timestamp()->set_nanos(nanos);
+
+                list.push_back(PostTable::instance().intern(message));
+            }
+
+            return true;
+        };
+
+        auto followers = IdSet {};
+        auto following = IdSet {};
+        auto timeline = RingBuffer<Post>(depth);
+        auto outbox = RingBuffer<Post>(depth);
+
+        if (!names(followers) || !names(following) || !messages(timeline))
+            return nullptr;
+
+        // Snapshots from before outboxes end after the timeline
+        if (cursor != end && !messages(outbox))
+            return nullptr;
+
+        auto user = std::make_shared<User>(username, std::move(following), std::move(followers), std::move(timeline));
+
+        user->outbox = std::move(outbox);
+        user->m_generation = generation;
+        user->m_log_valid = user->replay_log();
+
+        return user;
+    }
+
+    bool replay_log()
     {
-        if (timeline_context != nullptr && timeline_context->IsCancelled()) {
-            timeline_context = nullptr;
-            timeline_stream = nullptr;
+        auto file = std::ifstream(username + ".log");
+        auto line = std::string {};
+        // Reused for every post; interning copies it
+        auto message = csce438::Message {};
+        auto text = std::string {};
+
+        // Last follow or unfollow logged for each id, applied all at once when the log is read
+        auto follower_changes = std::unordered_map<UserId, bool> {};
+        auto following_changes = std::unordered_map<UserId, bool> {};
+
+        auto apply = [](IdSet& ids, std::unordered_map<UserId, bool> const& changes) {
+            auto added = std::vector<UserId> {};
+            auto removed = std::vector<UserId> {};
+
+            for (auto&& [id, follows] : changes)
+                (follows ? added : removed).push_back(id);
+
+            ids.update(std::move(added), std::move(removed));
+        };
+
+        // The first line is the generation of the snapshot this log applies to.
+        // An older log was already folded into the snapshot before the server stopped.
+        if (!std::getline(file, line) || line.empty() || std::stoul(line) != m_generation)
+            return false;
+
+        while (std::getline(file, line)) {
+            // A crash can leave a partially written record at the end of the log; stop there
+            if (line.size() != 1)
+                break;
+
+            auto record = line[0];
+            auto name = std::string {};
+
+            if (record == POST || record == OUTBOX_POST) {
+                auto timestamp = std::string {};
+                auto length = std::string {};
+
+                if (!std::getline(file, name) || !std::getline(file, timestamp) || !std::getline(file, length))
+                    break;
+
+                text.resize(std::stoul(length));
+
+                if (!file.read(&text[0], text.size()) || file.get() != '\n')
+                    break;
+
+                message.set_username(name);
+                message.set_msg(text);
+                google::protobuf::util::TimeUtil::FromString(timestamp, message.mutable_timestamp());
+
+                auto post = PostTable::instance().intern(message);
+
+                if (record == POST)
+                    push_timeline_message(post);
+                else
+                    push_outbox_message(post);
+
+                m_log_records++;
+
+                continue;
+            }
+
+            if (!std::getline(file, name))
+                break;
+
+            auto follower = record == FOLLOWER_ADD || record == FOLLOWER_REMOVE;
+            auto followed = record == FOLLOWING_ADD || record == FOLLOWING_REMOVE;
+
+            // An unknown record ends the replay
+            if (!follower && !followed)
+                break;
+
+            (follower ? follower_changes : following_changes)[UserIds::instance().intern(name)]
+                = record == FOLLOWER_ADD || record == FOLLOWING_ADD;
+
+            m_log_records++;
         }
+
+        apply(followers, follower_changes);
+        apply(following, following_changes);
+
+        return true;
     }
 
-    void add_timeline_message(csce438::Message message)
+    void verify_timeline_stream()
     {
-        // [IMPORTANT] Presumption is that user mutex is locked already
+        if (timeline_queue != nullptr && timeline_queue->closed())
+            timeline_queue = nullptr;
+    }
 
+    void push_timeline_message(Post const& message)
+    {
         // I feel it would be more natural to push_back then pop_front so that newer
         // messages are towards the bottom.
         // Test cases have it in reverse order, i.e. older at bottom.
+        // We want to store only the previous depth timeline messages; the ring drops the oldest
         timeline.push_front(message);
+    }
+
+    void push_outbox_message(Post const& message)
+    {
+        // Newest first and capped like the timeline, which is all a follower ever reads of it
+        outbox.push_front(message);
+    }
 
-        // We want to store only the previous 20 timeline messages
-        if (timeline.size() > 20)
-            timeline.pop_back();
+    void add_outbox_message(Post const& message)
+    {
+        // [IMPORTANT] Presumption is that user mutex is locked already
 
-        save_user_state();
+        push_outbox_message(message);
+        m_log_records++;
     }
 
-    void send_timeline_message(csce438::Message const& message)
+    void add_timeline_message(Post const& message)
     {
-        // Send message on stream if set
-        if (timeline_stream == nullptr)
-            return;
+        // [IMPORTANT] Presumption is that user mutex is locked already
+        // The caller logs the message with User::record(), built once for all followers
 
-        auto stream_lock = lock_t { timeline_mutex };
+        push_timeline_message(message);
+        m_log_records++;
+    }
 
-        if (timeline_context != nullptr && !timeline_context->IsCancelled()) {
-            timeline_stream->Write(message);
-        } else {
-            timeline_stream = nullptr;
-            timeline_context = nullptr;
-        }
+    /*
+     * Log records are built here and written by the persistence thread, see SNSServiceImpl::append()
+     *
+     * @return record to append to the log
+     */
+    static std::string record(LogRecord type, std::string const& name)
+    {
+        auto entry = std::string { static_cast<char>(type), '\n' };
+
+        entry += name;
+        entry += '\n';
+
+        return entry;
+    }
+
+    static std::string record(csce438::Message const& message, LogRecord type = POST)
+    {
+        // Message text is length-prefixed, so it may contain anything
+        auto entry = std::string { static_cast<char>(type), '\n' };
+
+        entry += message.username();
+        entry += '\n';
+        entry += google::protobuf::util::TimeUtil::ToString(message.timestamp());
+        entry += '\n';
+        entry += std::to_string(message.msg().size());
+        entry += '\n';
+        entry += message.msg();
+        entry += '\n';
+
+        return entry;
+    }
+
+    std::string log(LogRecord type, std::string const& name)
+    {
+        // [IMPORTANT] Presumption is that user mutex is locked already
+
+        m_log_records++;
+
+        return record(type, name);
+    }
 
-        stream_lock.unlock();
+    bool needs_compaction() const
+    {
+        // Fold the log into a new snapshot once replaying it costs more than reading a snapshot would
+        return !m_log_valid || m_log_records > std::max<size_t>(64, followers.size() + following.size() + timeline.size() + outbox.size());
     }
 
-    void save_user_state()
+    /*
+     * Serialize a full snapshot of the user; the log restarts empty once the snapshot is written.
+     * This is only done on creation and by the compactor; all other changes are appended to the log.
+     *
+     * u64 generation | u32 string count | strings | u32 follower count | follower string indices
+     * | u32 following count | following string indices
+     * | u32 timeline count | timeline * (u32 sender string index | i64 seconds | i32 nanos | message)
+     * | u32 outbox count | outbox * (same as timeline)
+     *
+     * Strings and messages are a u32 length followed by their bytes.
+     *
+     * @return record for server.snap
+     */
+    std::string snapshot()
     {
         // [IMPORTANT] Presumption is that user mutex is locked already
 
-        // This is terribly inefficent as we open the file on each call, clearing and rewriting entire file.
+        m_generation++;
+        m_log_records = 0;
+        m_log_valid = true;
+
+        // Usernames repeat across followers, following and timeline senders; store each once
+        auto table = std::unordered_map<std::string, uint32_t> {};
+        auto strings = std::vector<std::string const*> {};
 
-        // [IMPORTANT] User file is opened with TRUNC on each save.
-        m_file.open(username + ".usr", std::ios::trunc);
+        auto intern = [&](std::string const& string) {
+            auto [it, inserted] = table.emplace(string, strings.size());
 
-        m_file << username << '\n';
+            if (inserted)
+                strings.push_back(&it->first);
 
-        // 0x1BADFEED indicates beginning of followers
-        m_file << "\x1B\xAD\xFE\xED\n";
-        for (auto&& follower : followers)
-            m_file << follower << '\n';
+            return it->second;
+        };
 
-        // 0xC001D00D indicates beginning of following
-        m_file << "\xC0\x01\xD0\x0D\n";
-        for (auto&& followee : following)
-            m_file << followee << '\n';
+        auto indices = std::string {};
 
-        // Roastbeef (0x120457BEEF) indicates beginning timeline
-        m_file << "\x12\x04\x57\xBE\xEF\n";
-        for (auto&& message : timeline) {
-            m_file << message.username() << '\n'
-                   << message.msg() // we expect newline at end of msg
-                   << message.timestamp() << '\n';
+        for (auto* list : { &followers, &following }) {
+            SnapshotFile::put(indices, static_cast<uint32_t>(list->size()));
+
+            for (auto id : *list)
+                SnapshotFile::put(indices, intern(UserIds::instance().name(id)));
         }
 
-        m_file.flush();
-        m_file.close();
-    }
-};
+        for (auto* list : { &timeline, &outbox }) {
+            SnapshotFile::put(indices, static_cast<uint32_t>(list->size()));
 
-class SNSServiceImpl final : public SNSService::Service {
-private:
-    std::unordered_map<std::string, std::shared_ptr<User>> m_users;
-    std::mutex m_mutex;
-    std::ofstream m_file;
+            for (auto&& message : *list) {
+                SnapshotFile::put(indices, intern(message->username()));
+                SnapshotFile::put(indices, static_cast<int64_t>(message->timestamp().seconds()));
+                SnapshotFile::put(indices, static_cast<int32_t>(message->timestamp().nanos()));
+                SnapshotFile::put(indices, message->msg());
+            }
+        }
 
-public:
-    SNSServiceImpl()
-        : m_users({})
+        auto data = std::string {};
+
+        SnapshotFile::put(data, static_cast<uint64_t>(m_generation));
+        SnapshotFile::put(data, static_cast<uint32_t>(strings.size()));
+
+        for (auto* string : strings)
+            SnapshotFile::put(data, *string);
+
+        return data + indices;
+    }
+
+    // Rough estimate of the heap memory held by this user
+    size_t memory() const
     {
-        m_file = std::ofstream("server.dat", std::ios::app);
+        auto bytes = sizeof(User) + username.capacity();
 
-        auto file = std::ifstream("server.dat");
-        auto line = std::string {};
+        // Names are stored once in UserIds, not per user
+        for (auto* list : { &followers, &following })
+            bytes += list->capacity() * sizeof(UserId);
 
-        while (file >> line)
-            m_users[line] = User::from_file(line);
+        // Posts are shared; count each user's share of them
+        for (auto* list : { &timeline, &outbox })
+            for (auto&& message : *list)
+                bytes += sizeof(Post) + message->SpaceUsedLong() / std::max<long>(message.use_count(), 1);
+
+        return bytes;
     }
 
-    Status List(ServerContext* context, const Request* request, Reply* reply) override
+    // First line of a log that applies to the last snapshot
+    std::string log_header() const
     {
-        auto username = request->username();
-        auto lock = lock_t { m_mutex };
-        auto users = std::vector<std::string> {};
+        return std::to_string(m_generation) + '\n';
+    }
+};
+
+// Command line configurable settings of the server, see main()
+struct ServerOptions {
+    // When the persistence thread calls fsync(), and how often for FsyncPolicy::INTERVAL
+    FsyncPolicy fsync = FsyncPolicy::INTERVAL;
+    std::chrono::milliseconds interval = std::chrono::milliseconds { 1000 };
+    // Wait for changes to be committed and synced before replying; implies FsyncPolicy::BATCH
+    bool durable = false;
+    // Memory budget for resident users in bytes, 0 for no limit
+    size_t budget = 0;
+    // Load users at startup instead of on first use
+    bool warm = false;
+    // Threads used to load users at startup and to handle requests
+    size_t threads = std::thread::hardware_concurrency();
+    // Messages queued per timeline stream, and what happens to a stream that falls further behind
+    size_t queue_capacity = 1024;
+    OverflowPolicy overflow = OverflowPolicy::DROP_OLDEST;
+    // Posts of users with at least this many followers go to their outbox instead of their followers' timelines,
+    // 0 to always push posts to followers
+    size_t fanout_threshold = 1000;
+    // Messages kept in every timeline and outbox
+    size_t timeline_depth = 20;
+    // How often queue metrics are printed, 0 to never print them
+    std::chrono::seconds report = std::chrono::seconds { 0 };
+    // Write one in this many traced posts to trace.log, 0 to write none
+    size_t trace_every = 0;
+};
 
-        users.reserve(m_users.size());
+// Every RPC through the callback API; Timeline reads and writes raw bytes, so that each post is serialized once
+// for all the streams it goes to, see OutboundQueue::serialize()
+using SNSCallbackService = SNSService::WithCallbackMethod_Login<
+    SNSService::WithCallbackMethod_List<
+        SNSService::WithCallbackMethod_Follow<
+            SNSService::WithCallbackMethod_UnFollow<
+                SNSService::WithRawCallbackMethod_Timeline<
+                    SNSService::WithCallbackMethod_GetTimeline<
+                        SNSService::WithCallbackMethod_ListUsers<
+                            SNSService::WithCallbackMethod_Stats<SNSService::Service>>>>>>>>;
+
+class SNSServiceImpl final : public SNSCallbackService {
+private:
+    /*
+     * Users are spread over shards by their interned id, each with its own lock, so requests for
+     * different users rarely contend. A shard lock only guards the shard's map and eviction state; it is never
+     * held while locking a user, and it is taken exclusively only to register, load or evict users.
+     */
+    struct Evicted {
+        // Ticket of the last write queued for the user
+        uint64_t ticket;
+        // Size of its log as far as known, see append_evicted()
+        size_t log_bytes;
+    };
+
+    struct Shard {
+        std::shared_mutex mutex;
+
+        // Every registered user; users that are not resident map to nullptr and are loaded on first use, see load()
+        std::unordered_map<UserId, std::shared_ptr<User>> users;
+
+        size_t resident_bytes = 0;
+        // Resident users in the order the eviction clock visits them
+        std::vector<std::shared_ptr<User>> resident;
+        size_t hand = 0;
+        // Users evicted since startup, or never loaded but found to have a current log. New records are appended
+        // to their logs without loading them.
+        std::unordered_map<UserId, Evicted> evicted;
+        // Users being read back by load() without the shard lock held, and where others wait for them
+        std::unordered_set<UserId> loading;
+        std::condition_variable_any loaded;
+    };
+
+    static constexpr size_t SHARDS = 64;
+
+    // Size the log of a user that is not resident may grow to before the user is loaded, which compacts the log
+    static constexpr size_t EVICTED_LOG_BYTES = 64 << 10;
+
+    std::array<Shard, SHARDS> m_shards;
+
+    // Memory budget for resident users in bytes, 0 for no limit; every shard gets an equal share
+    size_t m_budget;
+    // Threads used to load users at startup
+    size_t m_threads;
+
+    // Snapshot of every user, see User::snapshot()
+    SnapshotFile m_snapshots;
+    // All writes to disk go through the persistence thread
+    Persistence m_persistence;
+    // Wait for changes to be committed before replying
+    bool m_durable;
+
+    // Bound of every timeline stream's outbound queue, see OutboundQueue
+    size_t m_queue_capacity;
+    OverflowPolicy m_overflow;
+
+    // Users with at least this many followers post to their outbox, see post()
+    size_t m_fanout_threshold;
+    // Users with a non-empty outbox, so that reading a timeline only loads the followed users that have one.
+    // Kept in outboxes.dat, which only ever grows.
+    std::unordered_set<UserId> m_outboxes;
+    std::shared_mutex m_outbox_mutex;
+
+    // Every registered user, in the order they were registered. It only ever grows, so its first n entries never
+    // change: a listing that stops at the size it saw when it started reads a consistent snapshot without holding
+    // the lock for longer than a page, see ListReactor.
+    std::deque<UserId> m_directory;
+    std::shared_mutex m_directory_mutex;
+
+    // Open timeline streams
+    std::atomic<size_t> m_streams;
+
+    // See stats()
+    Metrics& m_metrics;
+
+    // Users whose log should be folded into a new snapshot, handled by m_compactor
+    std::deque<std::shared_ptr<User>> m_compactions;
+    std::mutex m_compaction_mutex;
+    std::condition_variable m_compaction_ready;
+    bool m_stop;
+    std::thread m_compactor;
+
+    // Requests and replies of the unary RPCs are allocated in a per-RPC arena, see ArenaAllocator
+    ArenaAllocator<Request, Reply> m_allocator;
+    ArenaAllocator<TimelineRequest, TimelinePage> m_timeline_allocator;
+
+    // Runs the work of every RPC, see dispatch(); declared last so that it stops before anything it uses
+    WorkerPool m_workers;
+
+    void compact()
+    {
+        auto lock = lock_t { m_compaction_mutex };
 
-        for (auto&& user : m_users)
-            reply->add_all_users(user.first);
+        while (true) {
+            m_compaction_ready.wait(lock, [this]() { return m_stop || !m_compactions.empty(); });
 
-        for (auto&& follower : m_users[username]->followers)
-            reply->add_following_users(follower);
+            if (m_stop)
+                return;
 
-        lock.unlock();
+            auto user = std::move(m_compactions.front());
+            m_compactions.pop_front();
 
-        return Status::OK;
+            lock.unlock();
+
+            auto user_lock = lock_t { user->mutex };
+
+            user->compaction_pending = false;
+            save_user_state(user);
+
+            user_lock.unlock();
+
+            lock.lock();
+        }
     }
 
-    Status Follow(ServerContext* context, const Request* request, Reply* reply) override
+    /*
+     * Build users on every core, reporting progress while it runs
+     *
+     * @parameter count     number of users to build
+     * @parameter build     builds the user at an index
+     * @parameter budget    stop once the users built take this many bytes, 0 for no limit
+     *
+     * @return users that were built, in no particular order
+     */
+    template <typename F>
+    std::vector<std::shared_ptr<User>> build_users(size_t count, F&& build, size_t budget)
     {
-        auto username = request->username();
-        auto lock = lock_t { m_mutex };
+        auto threads = std::max<size_t>(1, std::min<size_t>(m_threads, count / 256));
+        auto results = std::vector<std::vector<std::shared_ptr<User>>>(threads);
+        auto workers = std::vector<std::thread> {};
 
-        if (!request->arguments_size()) {
-            // Target not supplied
-            reply->set_msg("bad name");
-            return Status::OK;
-        }
+        auto next = std::atomic<size_t> {};
+        auto done = std::atomic<size_t> {};
+        auto bytes = std::atomic<size_t> {};
+        auto running = threads;
 
-        auto target_username = request->arguments(0);
+        auto mutex = std::mutex {};
+        auto finished = std::condition_variable {};
 
-        if (m_users.find(target_username) == m_users.end()) {
-            // Target not exist
-            reply->set_msg("bad name");
-            return Status::OK;
-        }
+        auto start = std::chrono::steady_clock::now();
+        auto rate = [&start](size_t users) {
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return static_cast<size_t>(users / std::max(seconds, 1e-3));
+        };
 
-        auto const& user = m_users[username];
-        auto const& target = m_users[target_username];
+        for (auto i = size_t {}; i < threads; i++) {
+            workers.emplace_back([&, i]() {
+                // Take users in small chunks so a few large users do not leave one thread behind
+                constexpr auto chunk = size_t { 64 };
 
-        auto user_lock = lock_t { user->mutex };
-        auto target_lock = lock_t { target->mutex };
+                for (auto first = next.fetch_add(chunk); first < count; first = next.fetch_add(chunk)) {
+                    for (auto index = first; index < std::min(first + chunk, count); index++) {
+                        if (budget && bytes >= budget)
+                            break;
 
-        if (std::find(user->following.begin(), user->following.end(), target_username) != user->following.end()) {
-            // User already follows target
-            reply->set_msg("duplicate");
-            return Status::OK;
+                        auto user = build(index);
+
+                        bytes += user->memory();
+                        results[i].push_back(std::move(user));
+                    }
+
+                    done += std::min(chunk, count - first);
+                }
+
+                auto lock = lock_t { mutex };
+
+                if (!--running)
+                    finished.notify_one();
+            });
         }
 
-        // Add target to user following, user to target followers
-        user->following.push_back(target_username);
-        target->followers.push_back(username);
+        auto lock = lock_t { mutex };
 
-        user->save_user_state();
-        target->save_user_state();
+        while (!finished.wait_for(lock, std::chrono::seconds { 1 }, [&running]() { return !running; }))
+            std::cerr << "loading: " << done << '/' << count << " users (" << rate(done) << " users/s)\n";
 
-        target_lock.unlock();
-        user_lock.unlock();
         lock.unlock();
 
-        return Status::OK;
+        for (auto&& worker : workers)
+            worker.join();
+
+        auto users = std::vector<std::shared_ptr<User>> {};
+
+        for (auto&& result : results)
+            users.insert(users.end(), std::make_move_iterator(result.begin()), std::make_move_iterator(result.end()));
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+        std::cerr << "loaded " << users.size() << " users in " << elapsed.count() << "ms (" << rate(users.size())
+                  << " users/s, " << threads << " threads, " << (bytes >> 10) << " KiB)\n";
+
+        return users;
     }
 
-    Status UnFollow(ServerContext* context, const Request* request, Reply* reply) override
+    void convert()
     {
-        auto username = request->username();
-        auto lock = lock_t { m_mutex };
+        // Servers from before server.snap kept a text <username>.usr per user, listed in server.dat.
+        // Load those once and write them to the snapshot; the .usr files are not used afterwards.
+        auto file = std::ifstream("server.dat");
+        auto names = std::vector<std::string> {};
+        auto line = std::string {};
 
-        if (!request->arguments_size()) {
-            // Target not supplied
-            reply->set_msg("bad name");
-            return Status::OK;
-        }
+        while (file >> line)
+            names.push_back(line);
 
-        auto target_username = request->arguments(0);
+        if (names.empty())
+            return;
 
-        if (m_users.find(target_username) == m_users.end()) {
-            // Target does not exist
-            reply->set_msg("bad name");
-            return Status::OK;
+        auto users = build_users(
+            names.size(), [&names](size_t index) { return User::from_file(names[index]); }, 0);
+
+        for (auto&& user : users) {
+            save_user_state(user);
+            add_user(user);
+            add_to_directory(user->id);
         }
 
-        // Remove user from target's followers
-        auto const& target = m_users[target_username];
-        auto target_lock = lock_t { target->mutex };
-        auto pos = target->followers.end();
+        std::cerr << "converted " << users.size() << " users from .usr files to server.snap\n";
+    }
 
-        if ((pos = std::find(target->followers.begin(), target->followers.end(), username)) == target->followers.end()) {
-            // User was not following target
-            reply->set_msg("bad name");
-            return Status::OK;
-        }
+    // Load users up front instead of on first use, until the memory budget is reached
+    void preload()
+    {
+        auto records = m_snapshots.records();
 
-        target->followers.erase(pos);
-        target->save_user_state();
+        // Records point into the mapped snapshot or hold a copy, so the threads read them without going through
+        // SnapshotFile
+        auto users = build_users(
+            records.size(),
+            [&records](size_t index) {
+                auto user = User::from_snapshot(records[index].name, records[index].data, records[index].size);
 
-        target_lock.unlock();
+                if (!user) {
+                    std::cerr << "corrupt snapshot of " << records[index].name << '\n';
+                    exit(EXIT_FAILURE);
+                }
 
-        // Remove target from user's following
-        // We need not check if target in user's following since user is in followers of target
-        auto const& user = m_users[username];
-        auto user_lock = lock_t { user->mutex };
-        pos = std::find(user->following.begin(), user->following.end(), target_username);
+                return user;
+            },
+            m_budget);
 
-        user->following.erase(pos);
-        user->save_user_state();
+        for (auto&& user : users) {
+            // A stale log must be restarted before anything is appended to it
+            if (user->needs_compaction())
+                save_user_state(user);
 
-        user_lock.unlock();
-        lock.unlock();
+            add_user(user);
+        }
+    }
 
-        return Status::OK;
+    /*
+     * Queue a record to be appended to the user's log
+     *
+     * [IMPORTANT] Presumption is that user mutex is locked already, which keeps the log in the same order as
+     * the changes it records.
+     *
+     * @return ticket to pass to commit()
+     */
+    uint64_t append(std::shared_ptr<User> const& user, std::string record)
+    {
+        return user->ticket = m_persistence.append(user->username + ".log", std::move(record));
     }
 
-    Status Login(ServerContext* context, const Request* request, Reply* reply) override
+    // As append(), for records shared with other users' logs, such as a post fanned out to every follower
+    uint64_t append(std::shared_ptr<User> const& user, std::shared_ptr<std::string const> const& record)
     {
-        auto username = request->username();
-        auto lock = lock_t { m_mutex };
+        return user->ticket = m_persistence.append(user->username + ".log", record);
+    }
 
-        if (m_users.find(username) == m_users.end()) {
-            // By default a user follows themselves
-            m_users[username] = std::make_shared<User>(username,
-                                                       std::vector<std::string> { username },
-                                                       std::vector<std::string> { username },
-                                                       std::deque<csce438::Message> {});
+    uint64_t save_user_state(std::shared_ptr<User> const& user)
+    {
+        // [IMPORTANT] Presumption is that user mutex is locked already
 
-            m_users[username]->save_user_state();
+        auto snapshot = user->snapshot();
 
-            // Store username in server.dat
-            m_file << username << '\n';
-            m_file.flush();
-        } else {
-            // According to class announcements, it's undefined behaviour if
-            // two clients are connected with the same username, simultaneously.
-            // In this case, I invalidate the original user's stream/context
-            // so that they may be replaced by the new user should they enter timeline.
+        return user->ticket = m_persistence.snapshot(user->username, std::move(snapshot),
+                                                     user->username + ".log", user->log_header());
+    }
 
-            auto const& user = m_users[username];
-            auto user_lock = lock_t { user->mutex };
+    Shard& shard(UserId id)
+    {
+        // Ids are dense, so consecutive users land in consecutive shards
+        return m_shards[id % SHARDS];
+    }
 
-            user->timeline_stream = nullptr;
-            user->timeline_context = nullptr;
+    // Register a resident user
+    void add_user(std::shared_ptr<User> const& user)
+    {
+        auto& shard = this->shard(user->id);
+        auto lock = timed_lock<exclusive_lock_t>(shard.mutex, m_metrics.shard_lock);
 
-            user_lock.unlock();
-        }
+        shard.users[user->id] = user;
+        admit(shard, user);
+    }
 
-        lock.unlock();
+    /*
+     * Check that the log of a user that was never loaded belongs to its snapshot, so that records appended to it
+     * are replayed; a log left from an older snapshot is restarted when the user is loaded. Reads the generation
+     * the snapshot starts with and the first line of the log, not the user.
+     *
+     * @return size of the log, -1 if it is not current
+     */
+    off_t current_log_size(UserId id)
+    {
+        auto const& username = UserIds::instance().name(id);
+        auto generation = uint64_t {};
 
-        return Status::OK;
+        if (!m_snapshots.read(username, reinterpret_cast<char*>(&generation), sizeof(generation)))
+            return -1;
+
+        auto file = std::ifstream(username + ".log", std::ios::ate);
+        auto size = static_cast<off_t>(file.tellg());
+        auto line = std::string {};
+
+        file.seekg(0);
+
+        return std::getline(file, line) && line == std::to_string(generation) ? size : -1;
     }
 
-    __attribute__((flatten)) Status Timeline(ServerContext* context, ServerReaderWriter<Message, Message>* stream) override
+    /*
+     * Queue a log record for a user that is not resident, evicted or never loaded, without loading it
+     *
+     * @return ticket to pass to commit(), 0 if the user is resident or has to be loaded first
+     */
+    uint64_t append_evicted(UserId id, std::shared_ptr<std::string const> const& record)
     {
-        auto timeline_message = csce438::Message {};
-        auto lock = lock_t { m_mutex, std::defer_lock };
+        auto& shard = this->shard(id);
 
-        while (true) {
-            if (context->IsCancelled())
-                break;
+        // Called for every follower of every post, and followers are almost always resident; check that shared
+        auto shared_lock = timed_lock<shared_lock_t>(shard.mutex, m_metrics.shard_lock);
+        auto it = shard.users.find(id);
 
-            if (!stream->Read(&timeline_message))
-                continue;
+        if (it == shard.users.end() || it->second)
+            return 0;
 
-            lock.lock();
+        auto evicted = shard.evicted.find(id) != shard.evicted.end();
 
-            auto username = timeline_message.username();
-            auto pos = m_users.end();
+        shared_lock.unlock();
 
-            // I don't think we need to validate that a timeline message is from a valid user
-            if ((pos = m_users.find(username)) == m_users.end())
-                return Status::CANCELLED;
+        // A user that was never loaded is checked without the shard lock; the check holds until it is loaded
+        auto log_bytes = evicted ? off_t {} : current_log_size(id);
 
-            // Get user ptr and lock
-            auto const& user = m_users[username];
-            auto user_lock = lock_t { user->mutex };
+        if (log_bytes < 0)
+            return 0;
 
-            user->verify_timeline_stream();
+        // Exclusive, so that load() cannot read the user back between our check and the append
+        auto lock = timed_lock<exclusive_lock_t>(shard.mutex, m_metrics.shard_lock);
 
-            if (user->timeline_stream == nullptr) {
-                // Set stream if not already exists
-                if (timeline_message.msg() != "0xFEE1DEAD") {
-                    std::cerr << "something went terribly wrong\n";
-                    exit(EXIT_FAILURE);
-                }
+        if (shard.users[id] || shard.loading.find(id) != shard.loading.end())
+            return 0;
 
-                user->timeline_context = context;
-                user->timeline_stream = stream;
+        auto [entry, inserted] = shard.evicted.emplace(id, Evicted { 0, static_cast<size_t>(log_bytes) });
 
-                // Send accumulated timeline messages from before user entered timeline mode
-                for (auto&& msg : user->timeline)
-                    user->send_timeline_message(msg);
+        // Only loading the user compacts its log; once it has grown this far the caller loads the user instead
+        if (entry->second.log_bytes >= EVICTED_LOG_BYTES)
+            return 0;
 
-                user_lock.unlock();
-                lock.unlock();
+        entry->second.log_bytes += record->size();
+
+        return entry->second.ticket = m_persistence.append(UserIds::instance().name(id) + ".log", record);
+    }
+
+    // Make a user resident, evicting others if that exceeds the shard's budget
+    void admit(Shard& shard, std::shared_ptr<User> const& user)
+    {
+        // [IMPORTANT] Presumption is that the shard is locked exclusively already
 
+        user->footprint = user->memory();
+        shard.resident_bytes += user->footprint;
+        shard.resident.push_back(user);
+
+        evict(shard);
+    }
+
+    void evict(Shard& shard)
+    {
+        // [IMPORTANT] Presumption is that the shard is locked exclusively already
+
+        if (!m_budget)
+            return;
+
+        auto budget = std::max<size_t>(m_budget / SHARDS, 1);
+        auto& resident = shard.resident;
+
+        // CLOCK: the hand skips users used since it last passed them, clearing their bit so they go next time.
+        // Two passes clear every bit, so stop there if nothing could be evicted.
+        for (auto visited = size_t {}; shard.resident_bytes > budget && visited < 2 * resident.size(); visited++) {
+            if (shard.hand >= resident.size())
+                shard.hand = 0;
+
+            auto& user = resident[shard.hand];
+
+            // Only the shard holds a user nobody is using, so nobody else can be touching it
+            if (user.use_count() > 2) {
+                shard.hand++;
                 continue;
             }
 
-            if (timeline_message.msg() == "0xFEE1DEAD") {
-                /** FIXME: This is a hack.
-                 * The magic string is supposed to be used to set the pointer values for
-                 * context/stream objects, but for some reason we have past that point.
+            // Users grow after they are admitted; refresh the estimate as we pass
+            auto footprint = user->memory();
+            shard.resident_bytes = shard.resident_bytes - user->footprint + footprint;
+            user->footprint = footprint;
 
-                 * This scenario happens iff there are two active clients logged in as
-                 * the same user and attempting to enter timeline mode.
-                */
+            if (user->referenced) {
+                user->referenced = false;
+                shard.hand++;
+                continue;
+            }
 
-                user_lock.unlock();
-                lock.unlock();
+            // Keep users in timeline mode resident; their stream lives in the user object
+            user->verify_timeline_stream();
 
+            if (user->timeline_queue != nullptr) {
+                shard.hand++;
                 continue;
             }
 
-            // Iterate through all of user's followers, append message to timeline
-            for (auto&& follower_username : user->followers) {
-                auto const& follower = m_users[follower_username];
+            // The user's pending writes stay queued; load() waits for them before reading the user back
+            shard.evicted[user->id] = Evicted { user->ticket, 0 };
+            shard.users[user->id] = nullptr;
+            shard.resident_bytes -= user->footprint;
 
-                if (follower_username == username) {
-                    // We've locked user mutex already; don't deadlock by locking again
-                    user->add_timeline_message(timeline_message);
-                    continue;
-                }
-
-                auto follower_lock = lock_t { follower->mutex };
+            user = std::move(resident.back());
+            resident.pop_back();
+        }
+    }
 
-                follower->add_timeline_message(timeline_message);
+    /*
+     * Lock users in a fixed order (by id), so that two requests locking overlapping sets cannot deadlock.
+     * A user that appears more than once is locked once; nullptr entries are skipped.
+     */
+    static std::vector<lock_t> lock_users(std::vector<std::shared_ptr<User>> users)
+    {
+        users.erase(std::remove(users.begin(), users.end(), nullptr), users.end());
 
-                follower_lock.unlock();
+        std::sort(users.begin(), users.end(), [](auto const& a, auto const& b) { return a->id < b->id; });
+        users.erase(std::unique(users.begin(), users.end()), users.end());
 
-                // send_timeline_message locks stream mutex for us
-                follower->send_timeline_message(timeline_message);
-            }
+        auto locks = std::vector<lock_t> {};
+        locks.reserve(users.size());
 
-            user_lock.unlock();
+        for (auto&& user : users)
+            locks.push_back(timed_lock<lock_t>(user->mutex, Metrics::instance().user_lock));
 
-            auto grpc_timestamp = timeline_message.timestamp();
-            auto timestamp = google::protobuf::util::TimeUtil::TimestampToTimeT(grpc_timestamp);
+        return locks;
+    }
 
-            lock.unlock();
+    /*
+     * Log records of a batch, gathered per user so that each user's log gets a single append
+     *
+     * [IMPORTANT] Presumption is that every user added is locked until commit() is called
+     */
+    class Batch {
+    private:
+        std::map<UserId, std::pair<std::shared_ptr<User>, std::string>> m_records;
+
+    public:
+        void add(std::shared_ptr<User> const& user, User::LogRecord type, std::string const& name)
+        {
+            auto& [owner, records] = m_records[user->id];
+
+            owner = user;
+            records += user->log(type, name);
         }
 
-        return Status::OK;
+        // @return ticket to pass to SNSServiceImpl::commit()
+        uint64_t commit(SNSServiceImpl& service)
+        {
+            auto ticket = uint64_t {};
+
+            for (auto&& [id, entry] : m_records) {
+                ticket = service.append(entry.first, std::move(entry.second));
+                service.schedule_compaction(entry.first);
+            }
+
+            return ticket;
+        }
+    };
+
+    /*
+     * Run an RPC on the worker pool and reply once it returns. gRPC's callback threads must not block,
+     * and a handler may wait on a user lock, a disk read or a commit.
+     *
+     * @parameter latency   records the time from now until the handler returns
+     */
+    template <typename F>
+    ServerUnaryReactor* dispatch(CallbackServerContext* context, Histogram& latency, F&& handler)
+    {
+        auto* reactor = context->DefaultReactor();
+        auto start = std::chrono::steady_clock::now();
+
+        m_workers.submit([reactor, &latency, start, handler = std::forward<F>(handler)]() {
+            auto status = handler();
+
+            latency.record_since(start);
+            reactor->Finish(status);
+        });
+
+        return reactor;
+    }
+
+    void add_to_directory(UserId id)
+    {
+        auto lock = exclusive_lock_t { m_directory_mutex };
+        m_directory.push_back(id);
+    }
+
+    // A user if it is resident, without loading it
+    std::shared_ptr<User> resident(UserId id)
+    {
+        auto& shard = this->shard(id);
+        auto lock = timed_lock<shared_lock_t>(shard.mutex, m_metrics.shard_lock);
+        auto it = shard.users.find(id);
+
+        return it == shard.users.end() ? nullptr : it->second;
+    }
+
+    // Remember that a user has an outbox, so that timeline() merges it
+    void add_outbox(UserId id)
+    {
+        auto shared_lock = shared_lock_t { m_outbox_mutex };
+
+        if (m_outboxes.find(id) != m_outboxes.end())
+            return;
+
+        shared_lock.unlock();
+
+        auto lock = exclusive_lock_t { m_outbox_mutex };
+
+        // outboxes.dat keeps names; ids do not survive a restart
+        if (m_outboxes.insert(id).second)
+            m_persistence.append("outboxes.dat", UserIds::instance().name(id) + '\n');
+    }
+
+    // In durable mode, block until everything up to ticket is on disk
+    void commit(uint64_t ticket)
+    {
+        if (m_durable && ticket)
+            m_persistence.wait(ticket);
+    }
+
+    void schedule_compaction(std::shared_ptr<User> const& user)
+    {
+        // [IMPORTANT] Presumption is that user mutex is locked already
+
+        if (user->compaction_pending || !user->needs_compaction())
+            return;
+
+        user->compaction_pending = true;
+
+        auto lock = lock_t { m_compaction_mutex };
+        m_compactions.push_back(user);
+        lock.unlock();
+
+        m_compaction_ready.notify_one();
+    }
+
+public:
+    SNSServiceImpl(ServerOptions const& options)
+        : m_budget(options.budget)
+        , m_threads(std::max<size_t>(options.threads, 1))
+        , m_snapshots("server.snap")
+        , m_persistence(m_snapshots, options.fsync, options.interval)
+        , m_durable(options.durable)
+        , m_queue_capacity(options.queue_capacity)
+        , m_overflow(options.overflow)
+        , m_fanout_threshold(options.fanout_threshold)
+        , m_streams(0)
+        , m_metrics(Metrics::instance())
+        , m_stop(false)
+        , m_workers(m_threads)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        User::depth = std::max<size_t>(options.timeline_depth, 1);
+        Tracer::instance().sample_every(options.trace_every);
+
+        if (!m_snapshots.open())
+            exit(EXIT_FAILURE);
+
+        // Users are only registered here and loaded on first use
+        auto records = m_snapshots.records();
+
+        for (auto&& record : records) {
+            auto id = UserIds::instance().intern(record.name);
+            shard(id).users[id] = nullptr;
+            m_directory.push_back(id);
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+        std::cerr << "indexed " << records.size() << " users in " << elapsed.count() << "ms\n";
+
+        auto outboxes = std::ifstream("outboxes.dat");
+        auto name = std::string {};
+
+        while (std::getline(outboxes, name))
+            m_outboxes.insert(UserIds::instance().intern(name));
+
+        if (records.empty())
+            convert();
+        else if (options.warm)
+            preload();
+
+        m_compactor = std::thread(&SNSServiceImpl::compact, this);
+
+        SetMessageAllocatorFor_Login(&m_allocator);
+        SetMessageAllocatorFor_List(&m_allocator);
+        SetMessageAllocatorFor_Follow(&m_allocator);
+        SetMessageAllocatorFor_UnFollow(&m_allocator);
+        SetMessageAllocatorFor_GetTimeline(&m_timeline_allocator);
+    }
+
+    ~SNSServiceImpl()
+    {
+        auto lock = lock_t { m_compaction_mutex };
+        m_stop = true;
+        lock.unlock();
+
+        m_compaction_ready.notify_one();
+        m_compactor.join();
+    }
+
+    /*
+     * The RPCs themselves; the callback API entry points below run these on m_workers.
+     * They are public so that they can be driven without a server, see bench.cc.
+     */
+    Status list(const Request* request, Reply* reply)
+    {
+        auto username = request->username();
+
+        for (auto&& shard : m_shards) {
+            auto lock = timed_lock<shared_lock_t>(shard.mutex, m_metrics.shard_lock);
+
+            for (auto&& user : shard.users)
+                reply->add_all_users(UserIds::instance().name(user.first));
+        }
+
+        auto user = load(username);
+
+        if (user == nullptr)
+            return Status::CANCELLED;
+
+        auto user_lock = timed_lock<lock_t>(user->mutex, m_metrics.user_lock);
+
+        for (auto follower : user->followers)
+            reply->add_following_users(UserIds::instance().name(follower));
+
+        user_lock.unlock();
+
+        return Status::OK;
+    }
+
+    /*
+     * Follow and UnFollow apply every argument in one call. Each target gets its result in reply->results(),
+     * in the order of the arguments; reply->msg() is the first failure, as it was for a single target.
+     * All users involved are locked for the whole batch, and each one's log is appended to once.
+     */
+    Status follow(const Request* request, Reply* reply)
+    {
+        auto username = request->username();
+        auto user = load(username);
+
+        if (!request->arguments_size() || user == nullptr) {
+            // Target not supplied, or not a user to follow from
+            reply->set_msg("bad name");
+            return Status::OK;
+        }
+
+        auto targets = std::vector<std::shared_ptr<User>> {};
+
+        for (auto&& target_username : request->arguments())
+            targets.push_back(load(target_username));
+
+        auto users = targets;
+        users.push_back(user);
+
+        auto locks = lock_users(std::move(users));
+        auto batch = Batch {};
+
+        for (auto i = 0; i < request->arguments_size(); i++) {
+            auto const& target = targets[i];
+            auto const& target_username = request->arguments(i);
+            auto result = std::string { "ok" };
+
+            // Add target to user following, user to target followers
+            if (target == nullptr) {
+                // Target not exist
+                result = "bad name";
+            } else if (!user->following.insert(target->id)) {
+                // User already follows target
+                result = "duplicate";
+            } else {
+                target->followers.insert(user->id);
+
+                batch.add(user, User::FOLLOWING_ADD, target_username);
+                batch.add(target, User::FOLLOWER_ADD, username);
+            }
+
+            if (result != "ok" && reply->msg().empty())
+                reply->set_msg(result);
+
+            reply->add_results(result);
+        }
+
+        auto ticket = batch.commit(*this);
+
+        // Unlock every user before waiting for the commit
+        locks.clear();
+
+        commit(ticket);
+
+        return Status::OK;
+    }
+
+    Status unfollow(const Request* request, Reply* reply)
+    {
+        auto username = request->username();
+        auto user = load(username);
+
+        if (!request->arguments_size() || user == nullptr) {
+            // Target not supplied, or not a user to unfollow from
+            reply->set_msg("bad name");
+            return Status::OK;
+        }
+
+        auto targets = std::vector<std::shared_ptr<User>> {};
+
+        for (auto&& target_username : request->arguments())
+            targets.push_back(load(target_username));
+
+        auto users = targets;
+        users.push_back(user);
+
+        auto locks = lock_users(std::move(users));
+        auto batch = Batch {};
+
+        for (auto i = 0; i < request->arguments_size(); i++) {
+            auto const& target = targets[i];
+            auto const& target_username = request->arguments(i);
+            auto result = std::string { "ok" };
+
+            // Remove user from target's followers, target from user's following
+            // We need not check if target in user's following since user is in followers of target
+            if (target == nullptr || !target->followers.erase(user->id)) {
+                // Target does not exist, or user was not following target
+                result = "bad name";
+            } else {
+                user->following.erase(target->id);
+
+                batch.add(target, User::FOLLOWER_REMOVE, username);
+                batch.add(user, User::FOLLOWING_REMOVE, target_username);
+            }
+
+            if (result != "ok" && reply->msg().empty())
+                reply->set_msg(result);
+
+            reply->add_results(result);
+        }
+
+        auto ticket = batch.commit(*this);
+
+        // Unlock every user before waiting for the commit
+        locks.clear();
+
+        commit(ticket);
+
+        return Status::OK;
+    }
+
+    Status login(const Request* request, Reply*)
+    {
+        auto username = request->username();
+        auto id = UserIds::instance().intern(username);
+        auto ticket = uint64_t {};
+        auto& shard = this->shard(id);
+        auto lock = timed_lock<exclusive_lock_t>(shard.mutex, m_metrics.shard_lock);
+
+        if (shard.users.find(id) == shard.users.end()) {
+            // By default a user follows themselves
+            auto self = IdSet {};
+            self.insert(id);
+
+            auto user = std::make_shared<User>(username, self, self, RingBuffer<Post>(User::depth));
+
+            // The snapshot record also adds the user to server.snap
+            ticket = save_user_state(user);
+
+            shard.users[id] = user;
+            admit(shard, user);
+
+            lock.unlock();
+
+            add_to_directory(id);
+        } else {
+            // According to class announcements, it's undefined behaviour if
+            // two clients are connected with the same username, simultaneously.
+            // In this case, I invalidate the original user's stream/context
+            // so that they may be replaced by the new user should they enter timeline.
+
+            lock.unlock();
+
+            auto user = load(id);
+
+            if (user == nullptr)
+                return Status::CANCELLED;
+
+            auto user_lock = timed_lock<lock_t>(user->mutex, m_metrics.user_lock);
+
+            user->timeline_queue = nullptr;
+
+            user_lock.unlock();
+        }
+
+        commit(ticket);
+
+        return Status::OK;
+    }
+
+    /*
+     * Get a user, loading it from server.snap and its log if it is not resident
+     *
+     * Keep the returned pointer for as long as the user is used; loading another user may evict any user
+     * that is not held elsewhere.
+     *
+     * @return nullptr if there is no such user
+     */
+    std::shared_ptr<User> load(std::string const& username)
+    {
+        // Names that were never interned were never registered either
+        auto id = UserIds::instance().find(username);
+
+        return id == UserIds::NONE ? nullptr : load(id);
+    }
+
+    std::shared_ptr<User> load(UserId id)
+    {
+        auto& shard = this->shard(id);
+        auto shared_lock = timed_lock<shared_lock_t>(shard.mutex, m_metrics.shard_lock);
+        auto it = shard.users.find(id);
+
+        if (it == shard.users.end())
+            return nullptr;
+
+        if (it->second) {
+            it->second->referenced = true;
+            return it->second;
+        }
+
+        shared_lock.unlock();
+
+        // Loading changes the shard; check again, someone may have loaded the user in the meantime, or be loading it
+        auto lock = timed_lock<exclusive_lock_t>(shard.mutex, m_metrics.shard_lock);
+        shard.loaded.wait(lock, [&]() { return shard.loading.find(id) == shard.loading.end(); });
+
+        it = shard.users.find(id);
+
+        if (it->second) {
+            it->second->referenced = true;
+            return it->second;
+        }
+
+        // Writes queued while the user was evicted must be on disk before we read it back. Once it is no longer
+        // evicted, append_evicted() leaves new records to whoever loads the user, which waits for us.
+        auto ticket = uint64_t {};
+        auto evicted = shard.evicted.find(id);
+
+        if (evicted != shard.evicted.end()) {
+            ticket = evicted->second.ticket;
+            shard.evicted.erase(evicted);
+        }
+
+        shard.loading.insert(id);
+
+        // Waiting for a commit and reading the snapshot can take a while; the rest of the shard need not wait too
+        lock.unlock();
+
+        if (ticket)
+            m_persistence.wait(ticket);
+
+        auto const& username = UserIds::instance().name(id);
+        auto record = std::string {};
+        auto user = m_snapshots.read(username, record) ? User::from_snapshot(username, record.data(), record.size()) : nullptr;
+
+        if (!user)
+            std::cerr << "corrupt snapshot of " << username << '\n';
+
+        // A stale log must be restarted before anything is appended to it; nobody else has the user yet
+        if (user && user->needs_compaction())
+            save_user_state(user);
+
+        lock.lock();
+
+        shard.loading.erase(id);
+        shard.loaded.notify_all();
+
+        // A user that cannot be read is left unloaded, and requests for it fail
+        if (!user)
+            return nullptr;
+
+        shard.users[id] = user;
+        admit(shard, user);
+
+        return user;
+    }
+
+    // Queue a follower the frames of a post or batch; a traced batch is one delivery, ending with its last frame
+    static void push(OutboundQueue& queue, std::vector<ByteBuffer> const& frames,
+                     std::shared_ptr<PostTrace> const& trace)
+    {
+        for (auto i = size_t {}; i < frames.size(); i++)
+            queue.push(frames[i], i + 1 == frames.size() ? trace : nullptr);
+    }
+
+    /*
+     * Add a message to the timeline of every follower of its sender and queue it for those in timeline mode.
+     * Neither the shards nor the sender stay locked while the message fans out; each follower is locked in turn.
+     * Streams are written by their own writer, so a slow follower never holds up the poster.
+     *
+     * A sender with at least m_fanout_threshold followers instead stores the message once, in their outbox,
+     * and it is only queued for the followers in timeline mode; see timeline().
+     *
+     * @parameter trace     trace of the message, if it is sampled, see PostTrace
+     *
+     * @return ticket to pass to commit()
+     */
+    uint64_t post(std::shared_ptr<User> const& user, Post const& message,
+                  std::shared_ptr<PostTrace> const& trace = nullptr)
+    {
+        return post(user, std::vector<Post> { message }, trace);
+    }
+
+    /*
+     * Post several messages from the same sender, oldest first, as post() does one. The sender and each
+     * follower are locked once for the whole batch, and each one's log gets a single append.
+     *
+     * @return ticket to pass to commit()
+     */
+    uint64_t post(std::shared_ptr<User> const& user, std::vector<Post> const& messages,
+                  std::shared_ptr<PostTrace> const& trace = nullptr)
+    {
+        if (messages.empty())
+            return 0;
+
+        // A copy of the ids is 4 bytes per follower, and lets the sender go before the fan-out
+        auto user_lock = timed_lock<lock_t>(user->mutex, m_metrics.user_lock);
+        auto followers = user->followers;
+
+        for (auto i = size_t {}; i < messages.size(); i++)
+            m_metrics.fanout.record(followers.size());
+
+        // Messages as written to timeline streams, serialized once on the first follower that has one
+        auto frames = std::vector<ByteBuffer> {};
+
+        auto serialized = [&frames, &messages]() -> std::vector<ByteBuffer> const& {
+            if (frames.empty())
+                for (auto&& message : messages)
+                    frames.push_back(OutboundQueue::serialize(*message));
+
+            return frames;
+        };
+
+        if (m_fanout_threshold && followers.size() >= m_fanout_threshold) {
+            auto records = std::string {};
+
+            for (auto&& message : messages) {
+                user->add_outbox_message(message);
+                records += User::record(*message, User::OUTBOX_POST);
+            }
+
+            auto ticket = append(user, std::move(records));
+            schedule_compaction(user);
+
+            user_lock.unlock();
+
+            add_outbox(user->id);
+
+            // Users in timeline mode are always resident, so there is no need to load anyone
+            for (auto follower_id : followers) {
+                if (!m_streams)
+                    break;
+
+                auto follower = resident(follower_id);
+
+                // Users do not see their own posts in timeline mode
+                if (follower == nullptr || follower == user)
+                    continue;
+
+                auto follower_lock = timed_lock<lock_t>(follower->mutex, m_metrics.user_lock);
+
+                follower->verify_timeline_stream();
+                auto queue = follower->timeline_queue;
+
+                follower_lock.unlock();
+
+                if (queue == nullptr)
+                    continue;
+
+                push(*queue, serialized(), trace);
+            }
+
+            return ticket;
+        }
+
+        user_lock.unlock();
+
+        auto ticket = uint64_t {};
+        auto records = std::string {};
+
+        for (auto&& message : messages)
+            records += User::record(*message);
+
+        // Every follower's log gets the same records; they are built once and shared, not copied per follower
+        auto shared_records = std::make_shared<std::string const>(std::move(records));
+
+        // Iterate through all of user's followers, append messages to timeline
+        for (auto follower_id : followers) {
+            // Followers that are not resident are not in timeline mode; log the posts for when they are loaded
+            if (auto evicted = append_evicted(follower_id, shared_records)) {
+                ticket = evicted;
+                continue;
+            }
+
+            auto follower = load(follower_id);
+
+            if (follower == nullptr)
+                continue;
+
+            auto follower_lock = timed_lock<lock_t>(follower->mutex, m_metrics.user_lock);
+
+            for (auto&& message : messages)
+                follower->add_timeline_message(message);
+
+            ticket = append(follower, shared_records);
+            schedule_compaction(follower);
+
+            follower->verify_timeline_stream();
+            auto queue = follower->timeline_queue;
+
+            follower_lock.unlock();
+
+            // Users do not see their own posts in timeline mode
+            if (queue == nullptr || follower == user)
+                continue;
+
+            push(*queue, serialized(), trace);
+        }
+
+        return ticket;
     }
+
+    /*
+     * Timeline of a user as they see it: the messages pushed to their timeline merged with the outboxes of
+     * the users they follow, newest first and at most User::depth messages
+     */
+    std::vector<Post> timeline(std::shared_ptr<User> const& user)
+    {
+        auto user_lock = timed_lock<lock_t>(user->mutex, m_metrics.user_lock);
+        auto following = user->following;
+        auto lists = std::vector<std::vector<Post>> { { user->timeline.begin(), user->timeline.end() } };
+
+        user_lock.unlock();
+
+        auto outbox_lock = shared_lock_t { m_outbox_mutex };
+        auto outboxes = std::vector<UserId> {};
+
+        for (auto id : following)
+            if (m_outboxes.find(id) != m_outboxes.end())
+                outboxes.push_back(id);
+
+        outbox_lock.unlock();
+
+        for (auto id : outboxes) {
+            auto followed = load(id);
+
+            if (followed == nullptr)
+                continue;
+
+            auto followed_lock = timed_lock<lock_t>(followed->mutex, m_metrics.user_lock);
+            lists.emplace_back(followed->outbox.begin(), followed->outbox.end());
+        }
+
+        // k-way merge of the lists, each of which is newest first already
+        using Cursor = std::pair<std::vector<Post>::const_iterator, std::vector<Post>::const_iterator>;
+
+        auto older = [](Cursor const& a, Cursor const& b) {
+            return google::protobuf::util::TimeUtil::TimestampToNanoseconds((*a.first)->timestamp())
+                < google::protobuf::util::TimeUtil::TimestampToNanoseconds((*b.first)->timestamp());
+        };
+
+        auto heap = std::priority_queue<Cursor, std::vector<Cursor>, decltype(older)>(older);
+
+        for (auto&& list : lists)
+            if (!list.empty())
+                heap.emplace(list.cbegin(), list.cend());
+
+        auto messages = std::vector<Post> {};
+
+        while (!heap.empty() && messages.size() < User::depth) {
+            auto cursor = heap.top();
+            heap.pop();
+
+            messages.push_back(*cursor.first);
+
+            if (++cursor.first != cursor.second)
+                heap.push(cursor);
+        }
+
+        return messages;
+    }
+
+    /*
+     * Metrics of the server since it started, see Metrics. They are read without stopping anything, so they
+     * are not a snapshot of a single instant.
+     */
+    Status stats(const StatsRequest*, StatsReply* reply)
+    {
+        // zeros are values of 0 counted outside the histogram, the uncontended acquisitions of a lock
+        auto add = [reply](std::string name, std::string unit, Histogram const& histogram, uint64_t zeros = 0) {
+            auto* out = reply->add_histograms();
+
+            out->set_name(name);
+            out->set_unit(unit);
+            out->set_count(histogram.count() + zeros);
+            out->set_sum(histogram.sum());
+            out->set_max(histogram.max());
+            out->set_p50(histogram.percentile(0.50, zeros));
+            out->set_p90(histogram.percentile(0.90, zeros));
+            out->set_p99(histogram.percentile(0.99, zeros));
+
+            auto bucket = [&](size_t i) { return histogram.bucket_count(i) + (i ? 0 : zeros); };
+
+            // Trailing empty buckets are left out
+            auto used = Histogram::BUCKETS;
+
+            while (used && !bucket(used - 1))
+                used--;
+
+            for (auto i = size_t {}; i < used; i++)
+                out->add_buckets(bucket(i));
+        };
+
+        add("Login", "us", m_metrics.login);
+        add("List", "us", m_metrics.list);
+        add("Follow", "us", m_metrics.follow);
+        add("UnFollow", "us", m_metrics.unfollow);
+        add("GetTimeline", "us", m_metrics.get_timeline);
+        add("Timeline post", "us", m_metrics.post);
+        add("fan-out", "followers", m_metrics.fanout);
+        add("persistence commit", "us", m_metrics.commit);
+        add("shard lock wait", "ns", m_metrics.shard_lock.contended_waits(), m_metrics.shard_lock.uncontended_count());
+        add("user lock wait", "ns", m_metrics.user_lock.contended_waits(), m_metrics.user_lock.uncontended_count());
+
+        auto outbound = OutboundQueue::stats();
+
+        reply->set_timeline_streams(m_streams);
+        reply->set_bytes_written(m_metrics.bytes_written);
+        reply->set_queued(outbound.queued);
+        reply->set_sent(outbound.sent);
+        reply->set_dropped(outbound.dropped);
+        reply->set_disconnects(outbound.disconnects);
+        reply->set_queue_depth(outbound.depth);
+        reply->set_max_queue_depth(outbound.max_depth);
+
+        return Status::OK;
+    }
+
+    /*
+     * A page of a user's timeline, newest first, as timeline() assembles it. That is all the history the server
+     * keeps: the last User::depth messages (-n), and the outbox posts merged into them. Older messages are gone
+     * from every snapshot and log, so paging never reaches past them.
+     *
+     * The cursor is the position in that timeline the previous page ended at. Messages that arrive between two
+     * pages shift positions, so the next page may repeat messages from the end of the previous one.
+     */
+    Status get_timeline(const TimelineRequest* request, TimelinePage* reply)
+    {
+        auto user = load(request->username());
+
+        if (user == nullptr)
+            return Status::CANCELLED;
+
+        auto start = size_t {};
+
+        if (!request->cursor().empty()) {
+            try {
+                start = std::stoul(request->cursor());
+            } catch (std::exception const&) {
+                return Status(grpc::StatusCode::INVALID_ARGUMENT, "bad cursor");
+            }
+        }
+
+        auto messages = timeline(user);
+        auto size = static_cast<size_t>(request->page_size() ? request->page_size() : User::depth);
+        auto end = std::min(messages.size(), start + size);
+
+        for (auto i = start; i < end; i++)
+            *reply->add_messages() = *messages[i];
+
+        if (end < messages.size())
+            reply->set_next_cursor(std::to_string(end));
+
+        return Status::OK;
+    }
+
+    ServerUnaryReactor* GetTimeline(CallbackServerContext* context, const TimelineRequest* request, TimelinePage* reply) override
+    {
+        return dispatch(context, m_metrics.get_timeline, [=]() { return get_timeline(request, reply); });
+    }
+
+    ServerUnaryReactor* Stats(CallbackServerContext* context, const StatsRequest* request, StatsReply* reply) override
+    {
+        // Only reads counters, so it can reply right away
+        auto* reactor = context->DefaultReactor();
+        reactor->Finish(stats(request, reply));
+
+        return reactor;
+    }
+
+    ServerWriteReactor<ListPage>* ListUsers(CallbackServerContext*, const ListRequest* request) override
+    {
+        return new ListReactor(this, request);
+    }
+
+    ServerUnaryReactor* Login(CallbackServerContext* context, const Request* request, Reply* reply) override
+    {
+        return dispatch(context, m_metrics.login, [=]() { return login(request, reply); });
+    }
+
+    ServerUnaryReactor* List(CallbackServerContext* context, const Request* request, Reply* reply) override
+    {
+        return dispatch(context, m_metrics.list, [=]() { return list(request, reply); });
+    }
+
+    ServerUnaryReactor* Follow(CallbackServerContext* context, const Request* request, Reply* reply) override
+    {
+        return dispatch(context, m_metrics.follow, [=]() { return follow(request, reply); });
+    }
+
+    ServerUnaryReactor* UnFollow(CallbackServerContext* context, const Request* request, Reply* reply) override
+    {
+        return dispatch(context, m_metrics.unfollow, [=]() { return unfollow(request, reply); });
+    }
+
+    ServerBidiReactor<ByteBuffer, ByteBuffer>* Timeline(CallbackServerContext* context) override
+    {
+        return new TimelineReactor(this, context);
+    }
+
+private:
+    /*
+     * One ListUsers stream: the directory as it was when the stream started, filtered by prefix, a page per write.
+     * Pages are built on m_workers; the directory is only locked while a chunk of it is scanned, so neither a
+     * large directory nor a slow client holds up registrations.
+     */
+    class ListReactor final : public ServerWriteReactor<ListPage> {
+    private:
+        // Directory entries scanned per acquisition of the directory lock
+        static constexpr size_t CHUNK = 1024;
+
+        SNSServiceImpl* m_service;
+        std::string m_prefix;
+        size_t m_page_size;
+
+        // Next directory entry to scan, and the end of the snapshot being listed
+        size_t m_next;
+        size_t m_end;
+        bool m_written;
+
+        ListPage m_page;
+
+        void next()
+        {
+            m_page.Clear();
+
+            while (m_next < m_end && static_cast<size_t>(m_page.users_size()) < m_page_size) {
+                auto lock = shared_lock_t { m_service->m_directory_mutex };
+                auto end = std::min(m_end, m_next + CHUNK);
+
+                for (; m_next < end && static_cast<size_t>(m_page.users_size()) < m_page_size; m_next++) {
+                    auto const& name = UserIds::instance().name(m_service->m_directory[m_next]);
+
+                    if (name.compare(0, m_prefix.size(), m_prefix) == 0)
+                        m_page.add_users(name);
+                }
+            }
+
+            // Only the last page can come up short; an empty one is not worth a write unless it is the only one
+            if (m_page.users().empty() && m_written) {
+                Finish(Status::OK);
+                return;
+            }
+
+            if (m_next < m_end)
+                m_page.set_next_cursor(std::to_string(m_next));
+
+            m_written = true;
+            StartWrite(&m_page);
+        }
+
+    public:
+        ListReactor(SNSServiceImpl* service, const ListRequest* request)
+            : m_service(service)
+            , m_prefix(request->prefix())
+            , m_page_size(request->page_size() ? request->page_size() : 1000)
+            , m_next(0)
+            , m_written(false)
+        {
+            auto lock = shared_lock_t { m_service->m_directory_mutex };
+            m_end = m_service->m_directory.size();
+            lock.unlock();
+
+            if (!request->cursor().empty()) {
+                try {
+                    m_next = std::stoul(request->cursor());
+                } catch (std::exception const&) {
+                    m_next = m_end + 1;
+                }
+
+                if (m_next > m_end) {
+                    Finish(Status(grpc::StatusCode::INVALID_ARGUMENT, "bad cursor"));
+                    return;
+                }
+            }
+
+            m_service->m_workers.submit([this]() { next(); });
+        }
+
+        void OnWriteDone(bool ok) override
+        {
+            if (!ok) {
+                Finish(Status::CANCELLED);
+                return;
+            }
+
+            if (m_next >= m_end) {
+                Finish(Status::OK);
+                return;
+            }
+
+            m_service->m_workers.submit([this]() { next(); });
+        }
+
+        void OnDone() override
+        {
+            delete this;
+        }
+    };
+
+    /*
+     * One timeline stream. Reads form a chain: each message is handled on m_workers, which then starts the
+     * next read, so a stream holds no thread while it waits on its client and its posts are handled in order.
+     * Writes go through the stream's OutboundQueue, which also finishes the stream.
+     *
+     * A client that half-closes may still be reading its timeline, so the stream stays open until it is cancelled.
+     */
+    class TimelineReactor final : public ServerBidiReactor<ByteBuffer, ByteBuffer> {
+    private:
+        SNSServiceImpl* m_service;
+        CallbackServerContext* m_context;
+
+        // The stream is raw bytes; each read is parsed into m_message, which is reused for every message
+        ByteBuffer m_buffer;
+        Message m_message;
+        // When the read into m_buffer completed, for Metrics::post
+        std::chrono::steady_clock::time_point m_read_at;
+        std::shared_ptr<OutboundQueue> m_queue;
+
+        // Whoever sees the stream both done reading and cancelled closes it
+        std::mutex m_mutex;
+        bool m_reading;
+        bool m_cancelled;
+        bool m_closed;
+
+        void close(Status status)
+        {
+            // Without a queue nothing was ever written, so the stream can be finished right away
+            if (m_queue != nullptr)
+                m_queue->close(status);
+            else
+                Finish(status);
+        }
+
+        void stop_reading(Status status)
+        {
+            auto lock = lock_t { m_mutex };
+
+            m_reading = false;
+
+            auto close = !m_closed;
+            m_closed = true;
+
+            lock.unlock();
+
+            if (close)
+                this->close(status);
+        }
+
+        /*
+         * Fill in the server's timestamps of a post the client asked to trace
+         *
+         * @return whether the post is traced
+         */
+        bool stamp(Message& message)
+        {
+            if (!message.has_trace())
+                return false;
+
+            auto* trace = message.mutable_trace();
+
+            *trace->mutable_server_receive() = wall_time(m_read_at);
+            *trace->mutable_enqueue() = wall_time(std::chrono::steady_clock::now());
+
+            return true;
+        }
+
+        void handle()
+        {
+            auto parsed = grpc::SerializationTraits<Message>::Deserialize(&m_buffer, &m_message);
+
+            if (!parsed.ok()) {
+                stop_reading(parsed);
+                return;
+            }
+
+            // Our queue closes when the client is disconnected for falling behind or a write fails; stop reading
+            // rather than posting to a stream that is gone, or registering it for the user again
+            if (m_queue != nullptr && m_queue->closed()) {
+                stop_reading(Status::CANCELLED);
+                return;
+            }
+
+            auto username = m_message.username();
+
+            // Get user ptr and lock
+            auto user = m_service->load(username);
+
+            // I don't think we need to validate that a timeline message is from a valid user
+            if (user == nullptr) {
+                stop_reading(Status::CANCELLED);
+                return;
+            }
+
+            auto user_lock = timed_lock<lock_t>(user->mutex, m_service->m_metrics.user_lock);
+
+            user->verify_timeline_stream();
+
+            if (user->timeline_queue == nullptr && m_message.msg() != "0xFEE1DEAD") {
+                // A client has to enter timeline mode before it posts
+                if (m_queue == nullptr) {
+                    user_lock.unlock();
+                    stop_reading(Status(grpc::StatusCode::FAILED_PRECONDITION, "timeline mode was not entered"));
+                    return;
+                }
+
+                // The user's registered stream, another client's, has closed; ours is still open and takes over
+                user->timeline_queue = m_queue;
+            }
+
+            if (user->timeline_queue == nullptr) {
+                // Set stream if not already exists
+                if (m_queue == nullptr)
+                    m_queue = std::make_shared<OutboundQueue>(username, this, m_context, m_service->m_queue_capacity,
+                                                              m_service->m_overflow);
+
+                user->timeline_queue = m_queue;
+
+                user_lock.unlock();
+
+                // Send accumulated timeline messages from before user entered timeline mode
+                for (auto&& msg : m_service->timeline(user))
+                    m_queue->push(OutboundQueue::serialize(*msg));
+
+                StartRead(&m_buffer);
+                return;
+            }
+
+            if (m_message.msg() == "0xFEE1DEAD") {
+                /** FIXME: This is a hack.
+                 * The magic string is supposed to be used to set the pointer values for
+                 * context/stream objects, but for some reason we have past that point.
+
+                 * This scenario happens iff there are two active clients logged in as
+                 * the same user and attempting to enter timeline mode.
+                */
+
+                user_lock.unlock();
+
+                StartRead(&m_buffer);
+                return;
+            }
+
+            user_lock.unlock();
+
+            auto ticket = uint64_t {};
+            auto trace = std::shared_ptr<PostTrace> {};
+
+            if (m_message.has_batch()) {
+                // Many posts in one write, from bots and bridges; they fan out together, see post()
+                auto posts = std::vector<Post> {};
+                posts.reserve(m_message.batch().messages_size());
+
+                auto traced = static_cast<Message const*>(nullptr);
+
+                for (auto&& message : *m_message.mutable_batch()->mutable_messages()) {
+                    message.set_username(username);
+
+                    if (stamp(message) && traced == nullptr)
+                        traced = &message;
+
+                    posts.push_back(PostTable::instance().intern(message));
+                }
+
+                // A batch is sampled as one unit, named after its first traced post
+                if (traced && Tracer::instance().sample())
+                    trace = std::make_shared<PostTrace>(*traced, m_read_at, posts.size());
+
+                ticket = m_service->post(user, posts, trace);
+            } else {
+                if (stamp(m_message) && Tracer::instance().sample())
+                    trace = std::make_shared<PostTrace>(m_message, m_read_at);
+
+                // Stored once, however many timelines it goes to; m_message keeps its buffers for the next read
+                ticket = m_service->post(user, PostTable::instance().intern(m_message), trace);
+            }
+
+            if (trace)
+                trace->fanned_out();
+
+            m_service->commit(ticket);
+            m_service->m_metrics.post.record_since(m_read_at);
+
+            if (trace)
+                trace->committed();
+
+            StartRead(&m_buffer);
+        }
+
+    public:
+        TimelineReactor(SNSServiceImpl* service, CallbackServerContext* context)
+            : m_service(service)
+            , m_context(context)
+            , m_queue(nullptr)
+            , m_reading(true)
+            , m_cancelled(false)
+            , m_closed(false)
+        {
+            m_service->m_streams++;
+            StartRead(&m_buffer);
+        }
+
+        void OnReadDone(bool ok) override
+        {
+            if (ok) {
+                m_read_at = std::chrono::steady_clock::now();
+                m_service->m_workers.submit([this]() { handle(); });
+                return;
+            }
+
+            // The client half-closed or went away; no read is pending from here on
+            auto lock = lock_t { m_mutex };
+
+            m_reading = false;
+
+            auto close = (m_cancelled || m_queue == nullptr) && !m_closed;
+            m_closed = m_closed || close;
+
+            lock.unlock();
+
+            if (close)
+                this->close(Status::OK);
+        }
+
+        void OnWriteDone(bool ok) override
+        {
+            m_queue->written(ok);
+        }
+
+        void OnCancel() override
+        {
+            auto lock = lock_t { m_mutex };
+
+            m_cancelled = true;
+
+            // Otherwise the pending read fails and OnReadDone() closes the stream
+            auto close = !m_reading && !m_closed;
+            m_closed = m_closed || close;
+
+            lock.unlock();
+
+            if (close)
+                this->close(Status::CANCELLED);
+        }
+
+        void OnDone() override
+        {
+            m_service->m_streams--;
+            delete this;
+        }
+    };
 };
 
-void RunServer(std::string port_no)
+void RunServer(std::string port_no, ServerOptions const& options)
 {
     // ------------------------------------------------------------
     // In this function, you are to write code
@@ -486,7 +2227,7 @@ void RunServer(std::string port_no)
     // port number.
     // ------------------------------------------------------------
     auto address = std::string { "0.0.0.0:" } + port_no;
-    auto service = SNSServiceImpl();
+    auto service = SNSServiceImpl(options);
 
     ServerBuilder builder;
 
@@ -494,22 +2235,134 @@ void RunServer(std::string port_no)
     builder.RegisterService(&service);
 
     auto server = builder.BuildAndStart();
+
+    if (options.report.count()) {
+        // Runs for as long as the server does
+        std::thread([interval = options.report]() {
+            while (true) {
+                std::this_thread::sleep_for(interval);
+
+                auto stats = OutboundQueue::stats();
+
+                std::cerr << "outbound: " << stats.queued << " queued, " << stats.sent << " sent, " << stats.dropped
+                          << " dropped, " << stats.disconnects << " disconnects, queue depth " << stats.depth
+                          << " (max " << stats.max_depth << ")\n";
+
+                auto posts = PostTable::instance().stats();
+
+                std::cerr << "posts: " << posts.posts << " stored, " << posts.references << " references, "
+                          << (posts.bytes >> 10) << " KiB (" << (posts.copy_bytes >> 10) << " KiB as copies)\n";
+            }
+        }).detach();
+    }
+
     server->Wait();
 }
 
 int main(int argc, char** argv)
 {
     std::string port = "3010";
+    auto options = ServerOptions {};
+    auto convert = false;
     int opt = 0;
-    while ((opt = getopt(argc, argv, "p:")) != -1) {
+    while ((opt = getopt(argc, argv, "p:f:dcm:wj:q:o:s:t:n:T:")) != -1) {
         switch (opt) {
         case 'p':
             port = optarg;
             break;
+        case 'f': {
+            // -f none|batch|interval[:ms]
+            auto argument = std::string { optarg };
+
+            if (argument == "none") {
+                options.fsync = FsyncPolicy::NONE;
+            } else if (argument == "batch") {
+                options.fsync = FsyncPolicy::BATCH;
+            } else if (argument.rfind("interval", 0) == 0) {
+                options.fsync = FsyncPolicy::INTERVAL;
+
+                if (argument.size() > 9 && argument[8] == ':')
+                    options.interval = std::chrono::milliseconds { std::stoul(argument.substr(9)) };
+            } else {
+                std::cerr << "Invalid fsync policy " << argument << '\n';
+                return EXIT_FAILURE;
+            }
+
+            break;
+        }
+        case 'd':
+            options.durable = true;
+            break;
+        case 'c':
+            convert = true;
+            break;
+        case 'm':
+            // Memory budget for resident users in MiB
+            options.budget = std::stoul(optarg) << 20;
+            break;
+        case 'w':
+            // Load users at startup instead of on first use
+            options.warm = true;
+            break;
+        case 'j':
+            // Threads used to load users at startup
+            options.threads = std::stoul(optarg);
+            break;
+        case 'q':
+            // Messages queued per timeline stream
+            options.queue_capacity = std::stoul(optarg);
+            break;
+        case 'o': {
+            // -o drop-oldest|drop-newest|disconnect
+            auto argument = std::string { optarg };
+
+            if (argument == "drop-oldest") {
+                options.overflow = OverflowPolicy::DROP_OLDEST;
+            } else if (argument == "drop-newest") {
+                options.overflow = OverflowPolicy::DROP_NEWEST;
+            } else if (argument == "disconnect") {
+                options.overflow = OverflowPolicy::DISCONNECT;
+            } else {
+                std::cerr << "Invalid overflow policy " << argument << '\n';
+                return EXIT_FAILURE;
+            }
+
+            break;
+        }
+        case 's':
+            // Print queue metrics every this many seconds
+            options.report = std::chrono::seconds { std::stoul(optarg) };
+            break;
+        case 't':
+            // Followers from which posts go to the sender's outbox, 0 to always push posts to followers
+            options.fanout_threshold = std::stoul(optarg);
+            break;
+        case 'n':
+            // Messages kept in every timeline
+            options.timeline_depth = std::stoul(optarg);
+            break;
+        case 'T':
+            // Write one in this many traced posts to trace.log
+            options.trace_every = std::stoul(optarg);
+            break;
         default:
             std::cerr << "Invalid Command Line Argument\n";
         }
     }
-    RunServer(port);
+
+    // A durable reply means the change is on disk, which only a sync after every group commit guarantees
+    if (options.durable && options.fsync != FsyncPolicy::BATCH) {
+        std::cerr << "-d syncs after every group commit, as -f batch does\n";
+        options.fsync = FsyncPolicy::BATCH;
+    }
+
+    if (convert) {
+        // Loading converts any .usr files; destroying the service commits the snapshot
+        options.warm = false;
+        auto service = SNSServiceImpl(options);
+        return 0;
+    }
+
+    RunServer(port, options);
     return 0;
 }
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Fixed pool of threads running queued tasks in order.
+ *
+ * RPCs are served by gRPC's callback API, whose threads must not block; handlers hand their work, which may
+ * wait on a user lock, a disk read or a commit, to this pool instead.
+ */
+class WorkerPool {
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stop;
+
+    std::vector<std::thread> m_threads;
+
+    void run()
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+
+        while (true) {
+            m_ready.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+
+            if (m_tasks.empty())
+                return;
+
+            auto task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+
+            lock.unlock();
+
+            task();
+
+            lock.lock();
+        }
+    }
+
+public:
+    WorkerPool(size_t threads)
+        : m_stop(false)
+    {
+        for (auto i = size_t {}; i < std::max<size_t>(threads, 1); i++)
+            m_threads.emplace_back(&WorkerPool::run, this);
+    }
+
+    ~WorkerPool()
+    {
+        // Run whatever is still queued before joining
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_stop = true;
+        lock.unlock();
+
+        m_ready.notify_all();
+
+        for (auto&& thread : m_threads)
+            thread.join();
+    }
+
+    void submit(std::function<void()> task)
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mutex);
+        m_tasks.push_back(std::move(task));
+        lock.unlock();
+
+        m_ready.notify_one();
+    }
+
+    size_t size() const { return m_threads.size(); }
+};